@@ -0,0 +1,433 @@
+/*
+ * throughput and latency benchmark for the pb173 misc devices
+ *
+ * build: gcc -O2 -Wall -pthread -o pb173_bench pb173_bench.c
+ *
+ * every combination of thread count, I/O size and read/write mix is run for
+ * the given time and reported as one JSON object per line, e.g.
+ *
+ *   ./pb173_bench -d /dev/mydevice -t 1,2,4,8 -s 64,4096 -m 0,50,100
+ *   ./pb173_bench -d /dev/mydeviceR -w /dev/mydeviceW -t 1,4 -m 90
+ *   ./pb173_bench -d /dev/mydevice -n -r 20971520 -t 1,16,64
+ *
+ * the descriptors are always nonblocking. by default every operation first
+ * waits in poll() until the device is ready, at most until the end of the
+ * run, and the wait is part of its latency, so an empty or full ukol06 fifo
+ * can't hang a thread. -n does not wait, EAGAIN is counted but not timed.
+ * -r cycles pread/pwrite offsets over the given range (ukol05 buffer),
+ * without it plain read/write is used.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 32
+/* log-linear histogram: 2^SUB_BITS buckets per power of two */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_SIZE (64 * SUB_COUNT)
+
+struct config {
+	const char *rdev;
+	const char *wdev;
+	int threads[MAX_LIST];
+	int nthreads;
+	size_t sizes[MAX_LIST];
+	int nsizes;
+	int mixes[MAX_LIST];
+	int nmixes;
+	double duration;
+	off_t range;
+	int nonblock;
+};
+
+/* one benchmark run */
+struct run {
+	const struct config *cfg;
+	size_t size;
+	int read_pct;
+	volatile int stop;
+	/* no operation waits past this time */
+	uint64_t deadline;
+	/* descriptors shared by all threads when a device allows one writer */
+	int shared_rfd;
+	int shared_wfd;
+};
+
+struct thread {
+	pthread_t tid;
+	struct run *run;
+	unsigned int seed;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t eagain;
+	uint64_t max_ns;
+	uint64_t hist[HIST_SIZE];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns < SUB_COUNT)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - SUB_BITS + 1) * SUB_COUNT +
+		((ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* upper bound of the values falling to the bucket */
+static uint64_t hist_value(int bucket)
+{
+	int shift;
+
+	if (bucket < SUB_COUNT)
+		return bucket;
+
+	shift = bucket / SUB_COUNT - 1;
+	return ((uint64_t) (SUB_COUNT + bucket % SUB_COUNT + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+	double pct)
+{
+	uint64_t want = (uint64_t) (total * pct / 100.0), seen = 0;
+	int i;
+
+	/* every operation may have timed out */
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < HIST_SIZE; i++) {
+		seen += hist[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+
+	return hist_value(HIST_SIZE - 1);
+}
+
+static int parse_list(char *arg, long *out)
+{
+	char *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST;
+			tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 0);
+
+	return n;
+}
+
+/* open the device, fall back to the shared descriptor when it allows only
+ * one writer (ukol03, ukol05, ukol06) */
+static int open_dev(const char *path, int flags, int shared)
+{
+	int fd;
+
+	fd = open(path, flags | O_NONBLOCK);
+	if (fd < 0 && errno == EBUSY && shared >= 0)
+		return shared;
+
+	return fd;
+}
+
+/* wait until the descriptor is ready or the deadline passes, returns 0 on
+ * timeout like poll() */
+static int wait_ready(int fd, short events, uint64_t deadline)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = events,
+	};
+	uint64_t now = now_ns();
+
+	if (now >= deadline)
+		return 0;
+
+	return poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000));
+}
+
+static void *worker(void *data)
+{
+	struct thread *t = data;
+	struct run *run = t->run;
+	const struct config *cfg = run->cfg;
+	int rfd = -1, wfd = -1, do_read;
+	off_t off = 0;
+	uint64_t start, ns;
+	ssize_t ret;
+	char *buf;
+
+	buf = malloc(run->size);
+	if (buf == NULL)
+		return NULL;
+	memset(buf, 'a' + t->seed % 26, run->size);
+
+	if (run->read_pct > 0)
+		rfd = open_dev(cfg->rdev, O_RDONLY, run->shared_rfd);
+	if (run->read_pct < 100)
+		wfd = open_dev(cfg->wdev, O_WRONLY, run->shared_wfd);
+
+	if ((run->read_pct > 0 && rfd < 0) || (run->read_pct < 100 && wfd < 0)) {
+		perror("open");
+		t->errors++;
+		goto out;
+	}
+
+	while (!run->stop) {
+		do_read = (int) (rand_r(&t->seed) % 100) < run->read_pct;
+
+		start = now_ns();
+		if (!cfg->nonblock) {
+			ret = wait_ready(do_read ? rfd : wfd,
+				do_read ? POLLIN : POLLOUT, run->deadline);
+			/* the run is over */
+			if (ret == 0)
+				break;
+			if (ret < 0) {
+				if (errno != EINTR)
+					t->errors++;
+				continue;
+			}
+		}
+		if (cfg->range > 0) {
+			ret = do_read ? pread(rfd, buf, run->size, off) :
+				pwrite(wfd, buf, run->size, off);
+			off += run->size;
+			if (off + (off_t) run->size > cfg->range)
+				off = 0;
+		} else {
+			ret = do_read ? read(rfd, buf, run->size) :
+				write(wfd, buf, run->size);
+		}
+		ns = now_ns() - start;
+
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				t->eagain++;
+			else
+				t->errors++;
+			continue;
+		}
+
+		t->ops++;
+		t->bytes += ret;
+		t->hist[hist_bucket(ns)]++;
+		if (ns > t->max_ns)
+			t->max_ns = ns;
+	}
+
+out:
+	if (rfd >= 0 && rfd != run->shared_rfd)
+		close(rfd);
+	if (wfd >= 0 && wfd != run->shared_wfd)
+		close(wfd);
+	free(buf);
+
+	return NULL;
+}
+
+static int run_one(const struct config *cfg, int nthreads, size_t size,
+	int read_pct)
+{
+	struct run run = {
+		.cfg = cfg,
+		.size = size,
+		.read_pct = read_pct,
+		.shared_rfd = -1,
+		.shared_wfd = -1,
+	};
+	struct timespec sleep = {
+		.tv_sec = (time_t) cfg->duration,
+		.tv_nsec = (long) ((cfg->duration - (time_t) cfg->duration) *
+			1e9),
+	};
+	struct thread *threads;
+	uint64_t *hist, ops = 0, bytes = 0, errors = 0, eagain = 0, max = 0;
+	uint64_t start, elapsed;
+	double secs;
+	int i, j, ret;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	hist = calloc(HIST_SIZE, sizeof(*hist));
+	if (threads == NULL || hist == NULL) {
+		free(threads);
+		free(hist);
+		return -1;
+	}
+
+	/* devices with a single writer are used through one shared fd */
+	if (read_pct < 100)
+		run.shared_wfd = open(cfg->wdev, O_WRONLY | O_NONBLOCK);
+	if (read_pct > 0)
+		run.shared_rfd = open(cfg->rdev, O_RDONLY | O_NONBLOCK);
+
+	start = now_ns();
+	run.deadline = start + (uint64_t) (cfg->duration * 1e9);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].run = &run;
+		threads[i].seed = i + 1;
+		ret = pthread_create(&threads[i].tid, NULL, worker,
+			&threads[i]);
+		if (ret != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			break;
+		}
+	}
+
+	/* stop the threads which did start and report nothing */
+	if (i < nthreads) {
+		nthreads = i;
+		ret = -1;
+	} else {
+		nanosleep(&sleep, NULL);
+	}
+	run.stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		bytes += threads[i].bytes;
+		errors += threads[i].errors;
+		eagain += threads[i].eagain;
+		if (threads[i].max_ns > max)
+			max = threads[i].max_ns;
+		for (j = 0; j < HIST_SIZE; j++)
+			hist[j] += threads[i].hist[j];
+	}
+	elapsed = now_ns() - start;
+	secs = elapsed / 1e9;
+
+	if (run.shared_rfd >= 0)
+		close(run.shared_rfd);
+	if (run.shared_wfd >= 0)
+		close(run.shared_wfd);
+
+	if (ret != 0) {
+		free(threads);
+		free(hist);
+		return -1;
+	}
+
+	printf("{\"read_dev\":\"%s\",\"write_dev\":\"%s\",\"threads\":%d,"
+		"\"size\":%zu,\"read_pct\":%d,\"seconds\":%.3f,"
+		"\"ops\":%" PRIu64 ",\"ops_per_s\":%.1f,\"mb_per_s\":%.3f,"
+		"\"errors\":%" PRIu64 ",\"eagain\":%" PRIu64 ","
+		"\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ","
+		"\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+		cfg->rdev, cfg->wdev, nthreads, size, read_pct, secs,
+		ops, ops / secs, bytes / secs / 1e6, errors, eagain,
+		hist_percentile(hist, ops, 50.0),
+		hist_percentile(hist, ops, 99.0),
+		hist_percentile(hist, ops, 99.9), max);
+	fflush(stdout);
+
+	free(threads);
+	free(hist);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s -d device [-w write_device] "
+		"[-t threads,...] [-s sizes,...] [-m read_pcts,...] "
+		"[-D seconds] [-r range] [-n]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.threads = { 1 },
+		.nthreads = 1,
+		.sizes = { 4096 },
+		.nsizes = 1,
+		.mixes = { 50 },
+		.nmixes = 1,
+		.duration = 2.0,
+	};
+	long list[MAX_LIST];
+	int opt, i, t, s, m;
+
+	while ((opt = getopt(argc, argv, "d:w:t:s:m:D:r:nh")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.rdev = optarg;
+			break;
+		case 'w':
+			cfg.wdev = optarg;
+			break;
+		case 't':
+			cfg.nthreads = parse_list(optarg, list);
+			for (i = 0; i < cfg.nthreads; i++)
+				cfg.threads[i] = list[i];
+			break;
+		case 's':
+			cfg.nsizes = parse_list(optarg, list);
+			for (i = 0; i < cfg.nsizes; i++)
+				cfg.sizes[i] = list[i];
+			break;
+		case 'm':
+			cfg.nmixes = parse_list(optarg, list);
+			for (i = 0; i < cfg.nmixes; i++)
+				cfg.mixes[i] = list[i];
+			break;
+		case 'D':
+			cfg.duration = atof(optarg);
+			break;
+		case 'r':
+			cfg.range = strtoll(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.nonblock = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (cfg.rdev == NULL || cfg.duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (cfg.wdev == NULL)
+		cfg.wdev = cfg.rdev;
+
+	for (t = 0; t < cfg.nthreads; t++) {
+		for (s = 0; s < cfg.nsizes; s++) {
+			for (m = 0; m < cfg.nmixes; m++) {
+				if (cfg.threads[t] < 1 || cfg.sizes[s] < 1 ||
+						cfg.mixes[m] < 0 ||
+						cfg.mixes[m] > 100) {
+					fprintf(stderr, "bad parameters\n");
+					return 1;
+				}
+				if (run_one(&cfg, cfg.threads[t],
+						cfg.sizes[s], cfg.mixes[m]))
+					return 1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -4,9 +4,41 @@
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define MY_SET_LEN _IOW('t', 1, uint32_t)
 #define MY_GET_LEN _IOR('t', 2, uint64_t)
+#define MY_BATCH _IOWR('t', 3, struct my_batch)
+
+/* one command of MY_BATCH, ret is filled with its result */
+struct my_batch_cmd {
+	uint32_t cmd;
+	int32_t ret;
+	uint64_t arg;
+};
+
+/* argument of MY_BATCH, all count commands are run in one syscall */
+struct my_batch {
+	uint64_t cmds;
+	uint32_t count;
+	uint32_t pad;
+};
+
+/* per-CPU counters, summed up when the debugfs file is read */
+struct my_stats {
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 opens;
+};
+
+DEFINE_PER_CPU(struct my_stats, my_stats);
+struct dentry *my_debugfs;
+
+#define my_stat_add(field, val) this_cpu_add(my_stats.field, (val))
 
 uint32_t my_len = 4;
 
@@ -18,6 +50,9 @@ ssize_t my_read(struct file *filp, char __user *ptr, size_t count, loff_t *off)
 	if (copy_to_user(ptr, ret, my_len+1) != 0)
 		return -EFAULT;
 
+	my_stat_add(reads, 1);
+	my_stat_add(read_bytes, my_len+1);
+
 	return my_len+1;
 }
 
@@ -32,24 +67,28 @@ ssize_t my_write(struct file *filp, const char __user *ptr, size_t count,
 
 	buf[read] = '\0';
 
-	printk(KERN_INFO "User wrote: \"%s\"\n", buf);
+	/* only with dynamic debug enabled, it would flood the log */
+	pr_debug("User wrote: \"%s\"\n", buf);
+
+	my_stat_add(writes, 1);
+	my_stat_add(write_bytes, read);
 
 	return read;
 }
 
 int my_open(struct inode *inode, struct file *filp)
 {
-	printk(KERN_INFO "File opened\n");
+	my_stat_add(opens, 1);
 	return 0;
 }
 
 int my_release(struct inode *inode, struct file *filp)
 {
-	printk(KERN_INFO "Closing file\n");
 	return 0;
 }
 
-long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* run one command, used for both single and batched ioctls */
+static long my_cmd(unsigned int cmd, unsigned long arg)
 {
 	/* check command number */
 	switch (cmd) {
@@ -71,6 +110,42 @@ long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return 0;
 }
 
+/* run an array of commands, every command gets its own result */
+static long my_batch(struct my_batch __user *arg)
+{
+	struct my_batch batch;
+	struct my_batch_cmd c;
+	struct my_batch_cmd __user *cmds;
+	uint32_t i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)) != 0)
+		return -EFAULT;
+	cmds = u64_to_user_ptr(batch.cmds);
+
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(&c, &cmds[i], sizeof(c)) != 0)
+			return -EFAULT;
+
+		/* batches don't nest */
+		c.ret = c.cmd == MY_BATCH ? -EINVAL :
+			my_cmd(c.cmd, (unsigned long) c.arg);
+
+		if (put_user(c.ret, &cmds[i].ret) != 0)
+			return -EFAULT;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	if (cmd == MY_BATCH)
+		return my_batch((struct my_batch __user *) arg);
+
+	return my_cmd(cmd, arg);
+}
+
 const struct file_operations myfops = {
 	.owner = THIS_MODULE,
 	.read = my_read,
@@ -86,11 +161,40 @@ struct miscdevice mydevice = {
 	.fops = &myfops,
 };
 
+/* sum the per-CPU counters */
+static int my_stats_show(struct seq_file *m, void *v)
+{
+	struct my_stats sum = {}, *st;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&my_stats, cpu);
+		sum.reads += st->reads;
+		sum.writes += st->writes;
+		sum.read_bytes += st->read_bytes;
+		sum.write_bytes += st->write_bytes;
+		sum.opens += st->opens;
+	}
+
+	seq_printf(m, "reads: %llu\n", sum.reads);
+	seq_printf(m, "writes: %llu\n", sum.writes);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+	seq_printf(m, "opens: %llu\n", sum.opens);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_stats);
+
 static int my_init(void)
 {
+	my_debugfs = debugfs_create_dir("mydevice", NULL);
+	debugfs_create_file("stats", 0444, my_debugfs, NULL, &my_stats_fops);
+
 	misc_register(&mydevice);
 	printk(KERN_INFO "MY_SET_LEN: %u\n", MY_SET_LEN);
 	printk(KERN_INFO "MY_GET_LEN: %u\n", MY_GET_LEN);
+	printk(KERN_INFO "MY_BATCH: %u\n", MY_BATCH);
 
 	return 0;
 }
@@ -98,6 +202,7 @@ static int my_init(void)
 static void my_exit(void)
 {
 	misc_deregister(&mydevice);
+	debugfs_remove_recursive(my_debugfs);
 }
 
 module_init(my_init);
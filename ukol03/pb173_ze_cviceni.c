@@ -5,13 +5,26 @@
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/delay.h>
+#include <linux/seqlock.h>
+#include <linux/moduleparam.h>
 
+/* copy the whole write at once instead of one slow character at a time */
+static bool bulk;
+module_param(bulk, bool, 0444);
+MODULE_PARM_DESC(bulk, "Copy whole writes at once without delays");
+
+/* published snapshot, readers copy it under the seqlock and never wait */
 char buff[128];
+DEFINE_SEQLOCK(buff_seq);
+/* writer's working copy, writers serialize on the mutex */
+char wbuff[128];
 DEFINE_MUTEX(lock);
 
 static ssize_t my_read(struct file *filp, char __user *buf, size_t count,
 		loff_t *off)
 {
+	char snap[sizeof(buff)];
+	unsigned int seq;
 	int c;
 
 	if (*off >= sizeof(buff) || !count)
@@ -19,14 +32,15 @@ static ssize_t my_read(struct file *filp, char __user *buf, size_t count,
 
 	c = (count + *off >= sizeof(buff)) ? sizeof(buff) - *off : count;
 
-	/* lock before reading the buffer */
-	mutex_lock(&lock);
-	if (copy_to_user(buf, &buff[*off], c) != 0) {
-		mutex_unlock(&lock);
+	/* take a consistent snapshot, retry if a writer published meanwhile */
+	do {
+		seq = read_seqbegin(&buff_seq);
+		memcpy(snap, &buff[*off], c);
+	} while (read_seqretry(&buff_seq, seq));
+
+	/* copy to user outside of the seqlock, it may fault and sleep */
+	if (copy_to_user(buf, snap, c) != 0)
 		return -EFAULT;
-	}
-	/* unlock after reading the buffer */
-	mutex_unlock(&lock);
 
 	*off += c;
 	return c;
@@ -40,34 +54,47 @@ ssize_t my_write(struct file *file, const char __user *ptr, size_t count,
 	if (*off >= sizeof(buff) || !count)
 		return 0;
 
-	/* allow at most 5 characters */
-	c = (count > 5) ? 5 : count;
+	/* allow at most 5 characters (unless copying in bulk) */
+	c = (count > 5 && !bulk) ? 5 : min_t(size_t, count, sizeof(buff));
 
 
 	/* check how much space remains in the buffer */
 	if (sizeof(buff) - *off < c)
 		c = sizeof(buff) - *off;
 
-	/* critical section: work with buffer */
+	/* critical section: work with the writer's copy */
 	mutex_lock(&lock);
 
-	/* copy to buffer one character per iteration */
-	for (i = 0; i < c; i++) {
-		if (copy_from_user(&buff[*off+i], ptr+i, 1) != 0) {
-			/* don't forget to release the lock on error */
+	if (bulk) {
+		if (copy_from_user(&wbuff[*off], ptr, c) != 0) {
 			mutex_unlock(&lock);
 			return -EFAULT;
 		}
-		msleep(10);
+	} else {
+		/* copy to buffer one character per iteration */
+		for (i = 0; i < c; i++) {
+			if (copy_from_user(&wbuff[*off+i], ptr+i, 1) != 0) {
+				/* don't forget to release the lock on error */
+				mutex_unlock(&lock);
+				return -EFAULT;
+			}
+			msleep(10);
+		}
 	}
 
+	/* publish the finished part, readers see all of it or none */
+	write_seqlock(&buff_seq);
+	memcpy(&buff[*off], &wbuff[*off], c);
+	write_sequnlock(&buff_seq);
+
+	/* debug output of this write, taken from the writer's copy which
+	 * nobody else changes while we hold the mutex, it is not terminated */
+	pr_debug("User wrote: \"%.*s\"\n", c, &wbuff[*off]);
+
 	*off += c;
 	/* unlock after write */
 	mutex_unlock(&lock);
 
-	/* debug output */
-	printk(KERN_INFO "User wrote: \"%s\"\n", buff);
-
 	return c;
 }
 
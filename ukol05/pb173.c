@@ -11,64 +11,432 @@
 #include <linux/kernel.h>
 #include <linux/io.h>
 #include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/version.h>
+/* pfn_t is gone since 6.17, vmf_insert_pfn_pmd takes a plain pfn there */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
 
 #define MY_SET_LEN _IOW('t', 1, uint32_t)
 #define MY_GET_LEN _IOR('t', 2, uint64_t)
-#define BUF_SIZE 20971520 /* 20*2^20 */
+#define MY_SET_SIZE _IOW('t', 3, uint64_t)
+#define MY_GET_SIZE _IOR('t', 4, uint64_t)
+#define CHUNK_SHIFT 21 /* the buffer is made of 2 MiB chunks */
+#define CHUNK_SIZE (1UL << CHUNK_SHIFT)
+#define MAX_SIZE (1ULL << 40)
+
+static unsigned long buf_size = 20971520; /* 20*2^20 */
+module_param(buf_size, ulong, 0444);
+MODULE_PARM_DESC(buf_size, "Initial buffer size, rounded up to 2 MiB");
+
+/* back the chunks by physically contiguous 2 MiB pages where possible */
+static bool huge = true;
+module_param(huge, bool, 0444);
+MODULE_PARM_DESC(huge, "Try to allocate 2 MiB pages for the buffer");
+
+/* one piece of the buffer, also the unit of locking */
+struct my_chunk {
+	char *virt;
+	/* contiguous pages in the direct map, vmalloc_user memory otherwise */
+	bool huge;
+	/* readers share the chunk, writers lock only the chunks they touch */
+	struct rw_semaphore lock;
+};
+
+/* per-CPU counters, summed up when the debugfs file is read */
+struct my_stats {
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 short_reads;
+	u64 short_writes;
+	u64 lock_wait_ns;
+	u64 opens;
+};
+
+DEFINE_PER_CPU(struct my_stats, my_stats);
+struct dentry *my_debugfs;
+
+#define my_stat_add(field, val) this_cpu_add(my_stats.field, (val))
 
 atomic_t my_len = ATOMIC_INIT(4);
 atomic_t my_opened = ATOMIC_INIT(0);
-DEFINE_MUTEX(lock);
-char *buf;
+/* number of vmas mapping the buffer, it can't be resized while mapped */
+atomic_t my_mapped = ATOMIC_INIT(0);
+/* resize holds this for writing, everybody else for reading */
+DECLARE_RWSEM(resize_lock);
+/* only one resize at a time, allocations are done outside resize_lock */
+DEFINE_MUTEX(resize_mutex);
+struct my_chunk *chunks;
+unsigned long chunk_count;
+
+static inline loff_t my_size(void)
+{
+	return (loff_t) chunk_count << CHUNK_SHIFT;
+}
+
+static int my_alloc_chunk(struct my_chunk *ch)
+{
+	void *virt = NULL;
+
+	/* don't try too hard, fall back to vmalloc when memory is fragmented.
+	 * the exact allocation is split to order 0 pages, so single pages
+	 * can be mapped to user space. it is a naturally aligned buddy block,
+	 * so shared mappings can map it by one pmd */
+	if (huge)
+		virt = alloc_pages_exact(CHUNK_SIZE, GFP_KERNEL | __GFP_ZERO |
+			__GFP_NOWARN | __GFP_NORETRY);
+
+	if (virt != NULL) {
+		ch->virt = virt;
+		ch->huge = true;
+	} else {
+		ch->virt = vmalloc_user(CHUNK_SIZE);
+		ch->huge = false;
+		if (ch->virt == NULL)
+			return -ENOMEM;
+	}
+
+	init_rwsem(&ch->lock);
+	return 0;
+}
+
+static void my_free_chunk(struct my_chunk *ch)
+{
+	if (ch->huge)
+		free_pages_exact(ch->virt, CHUNK_SIZE);
+	else
+		vfree(ch->virt);
+}
+
+/* page backing offset off of the chunk */
+static struct page *my_chunk_page(struct my_chunk *ch, unsigned long off)
+{
+	if (ch->huge)
+		return virt_to_page(ch->virt + off);
+	return vmalloc_to_page(ch->virt + off);
+}
+
+/* lock the chunk, readers share it */
+static void my_lock_chunk(struct my_chunk *ch, int write)
+{
+	u64 start = local_clock();
+
+	if (write)
+		down_write(&ch->lock);
+	else
+		down_read(&ch->lock);
+
+	my_stat_add(lock_wait_ns, local_clock() - start);
+}
+
+static void my_unlock_chunk(struct my_chunk *ch, int write)
+{
+	if (write)
+		up_write(&ch->lock);
+	else
+		up_read(&ch->lock);
+}
 
-ssize_t my_read(struct file *filp, char __user *ptr, size_t count, loff_t *off)
+/* copy between the buffer and the iterator chunk by chunk, holding only
+ * the lock of the chunk being copied. a transfer over more chunks is not
+ * atomic as a whole, every piece of it is */
+static size_t my_copy_iter(loff_t off, size_t len, struct iov_iter *iter,
+	int write)
 {
-	int read;
+	struct my_chunk *ch;
+	size_t done = 0, n, c, coff;
+
+	while (done < len) {
+		ch = &chunks[(off + done) >> CHUNK_SHIFT];
+		coff = (off + done) & (CHUNK_SIZE - 1);
+		n = min_t(size_t, len - done, CHUNK_SIZE - coff);
+
+		my_lock_chunk(ch, write);
+		if (write)
+			c = copy_from_iter(ch->virt + coff, n, iter);
+		else
+			c = copy_to_iter(ch->virt + coff, n, iter);
+		my_unlock_chunk(ch, write);
+
+		done += c;
+		/* stop at the first fault */
+		if (c < n)
+			break;
+	}
+
+	return done;
+}
 
-	if (*off >= BUF_SIZE || !count)
+/* read at iocb->ki_pos, the iterator may scatter to many user segments */
+ssize_t my_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	loff_t off = iocb->ki_pos;
+	size_t len = iov_iter_count(to), read;
+
+	down_read(&resize_lock);
+	if (off >= my_size() || !len) {
+		up_read(&resize_lock);
 		return 0;
+	}
+
+	if (len > my_size() - off)
+		len = my_size() - off;
 
-	read = (count + *off >= BUF_SIZE) ? BUF_SIZE - *off : count;
+	/* lock the chunks we read one by one, other readers may use them too */
+	read = my_copy_iter(off, len, to, 0);
+	up_read(&resize_lock);
 
-	/* lock before reading the buffer */
-	mutex_lock(&lock);
-	if (copy_to_user(ptr, &buf[*off], read) != 0) {
-		mutex_unlock(&lock);
+	if (!read)
 		return -EFAULT;
-	}
-	/* unlock after reading the buffer */
-	mutex_unlock(&lock);
 
-	*off += read;
+	my_stat_add(reads, 1);
+	my_stat_add(read_bytes, read);
+	/* the iterator still has room left */
+	if (iov_iter_count(to))
+		my_stat_add(short_reads, 1);
+
+	iocb->ki_pos += read;
 	return read;
 }
 
-ssize_t my_write(struct file *filp, const char __user *ptr, size_t count,
-	loff_t *off)
+/* write at iocb->ki_pos, the iterator may gather from many user segments */
+ssize_t my_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	int write;
+	loff_t off = iocb->ki_pos;
+	size_t len = iov_iter_count(from), write;
 
-	if (*off >= BUF_SIZE || !count)
+	down_read(&resize_lock);
+	if (off >= my_size() || !len) {
+		up_read(&resize_lock);
 		return 0;
+	}
+
+	if (len > my_size() - off)
+		len = my_size() - off;
 
-	write = (count + *off >= BUF_SIZE) ? BUF_SIZE - *off : count;
+	/* lock only the chunk being written, we want some consistency... */
+	write = my_copy_iter(off, len, from, 1);
+	up_read(&resize_lock);
 
-	/* lock lock before writing, we want some consistency... */
-	mutex_lock(&lock);
-	if (copy_from_user(&buf[*off], ptr, write) != 0) {
-		mutex_unlock(&lock);
+	if (!write)
 		return -EFAULT;
-	}
-	/* no more work with buffer, free the lock */
-	mutex_unlock(&lock);
 
-	*off += count;
+	my_stat_add(writes, 1);
+	my_stat_add(write_bytes, write);
+	if (iov_iter_count(from))
+		my_stat_add(short_writes, 1);
 
-	printk(KERN_INFO "User wrote: \"%s\"\n", buf);
+	iocb->ki_pos += write;
 
 	return write;
 }
 
+/* positions are bounded by the buffer size, SEEK_END is its end */
+loff_t my_llseek(struct file *filp, loff_t off, int whence)
+{
+	loff_t ret;
+
+	down_read(&resize_lock);
+	ret = fixed_size_llseek(filp, off, whence, my_size());
+	up_read(&resize_lock);
+
+	return ret;
+}
+
+/* change the buffer size, existing data up to the new size are kept */
+static int my_resize(uint64_t size)
+{
+	struct my_chunk *new;
+	unsigned long count, old, i;
+	int ret = 0;
+
+	if (size == 0 || size > MAX_SIZE)
+		return -EINVAL;
+	count = round_up(size, CHUNK_SIZE) >> CHUNK_SHIFT;
+
+	mutex_lock(&resize_mutex);
+	old = chunk_count;
+
+	new = kvcalloc(count, sizeof(*new), GFP_KERNEL);
+	if (new == NULL) {
+		mutex_unlock(&resize_mutex);
+		return -ENOMEM;
+	}
+
+	/* allocate the new chunks without blocking the readers, up to
+	 * hundreds of thousands of them, so let the caller be killed */
+	for (i = old; i < count; i++) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		ret = my_alloc_chunk(&new[i]);
+		if (ret != 0)
+			break;
+	}
+
+	down_write(&resize_lock);
+	if (ret == 0 && atomic_read(&my_mapped) != 0)
+		ret = -EBUSY;
+
+	if (ret == 0) {
+		/* nobody holds a chunk lock now, move the chunks we keep */
+		for (i = 0; i < min(old, count); i++) {
+			new[i].virt = chunks[i].virt;
+			new[i].huge = chunks[i].huge;
+			init_rwsem(&new[i].lock);
+		}
+		swap(new, chunks);
+		chunk_count = count;
+	}
+	up_write(&resize_lock);
+
+	/* on success free the dropped chunks of the old array, on failure
+	 * the chunks allocated for the new one */
+	if (ret == 0) {
+		for (i = count; i < old; i++)
+			my_free_chunk(&new[i]);
+	} else {
+		for (i = old; i < count && new[i].virt != NULL; i++)
+			my_free_chunk(&new[i]);
+	}
+	kvfree(new);
+
+	mutex_unlock(&resize_mutex);
+	return ret;
+}
+
+void my_vma_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&my_mapped);
+}
+
+void my_vma_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&my_mapped);
+}
+
+/* insert the page of the right chunk on the first access */
+vm_fault_t my_fault(struct vm_fault *vmf)
+{
+	loff_t off = (loff_t) vmf->pgoff << PAGE_SHIFT;
+	struct page *page;
+
+	/* the buffer can't shrink while it is mapped */
+	if (off >= my_size())
+		return VM_FAULT_SIGBUS;
+
+	page = my_chunk_page(&chunks[off >> CHUNK_SHIFT],
+		off & (CHUNK_SIZE - 1));
+	get_page(page);
+	vmf->page = page;
+
+	return 0;
+}
+
+const struct vm_operations_struct my_vm_ops = {
+	.open = my_vma_open,
+	.close = my_vma_close,
+	.fault = my_fault,
+};
+
+/* shared mappings insert pfns, no struct page is referenced and the
+ * pages stay until the last mapping is gone since resize refuses to run */
+vm_fault_t my_pfn_fault(struct vm_fault *vmf)
+{
+	loff_t off = (loff_t) vmf->pgoff << PAGE_SHIFT;
+
+	if (off >= my_size())
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(
+		my_chunk_page(&chunks[off >> CHUNK_SHIFT],
+		off & (CHUNK_SIZE - 1))));
+}
+
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+/* map a whole contiguous chunk by one pmd when the mapping is aligned to
+ * it, vmalloc chunks and the unaligned rest go page by page */
+vm_fault_t my_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long addr = vmf->address & PMD_MASK;
+	pgoff_t pgoff;
+	struct my_chunk *ch;
+
+	if (order != PMD_ORDER || PMD_SIZE != CHUNK_SIZE)
+		return VM_FAULT_FALLBACK;
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+	if (pgoff & ((CHUNK_SIZE >> PAGE_SHIFT) - 1))
+		return VM_FAULT_FALLBACK;
+	if (((loff_t) pgoff << PAGE_SHIFT) >= my_size())
+		return VM_FAULT_SIGBUS;
+
+	ch = &chunks[pgoff >> (CHUNK_SHIFT - PAGE_SHIFT)];
+	if (!ch->huge)
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(
+		page_to_pfn(virt_to_page(ch->virt)), PFN_DEV),
+		vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, page_to_pfn(virt_to_page(ch->virt)),
+		vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#endif
+
+const struct vm_operations_struct my_vm_pfn_ops = {
+	.open = my_vma_open,
+	.close = my_vma_close,
+	.fault = my_pfn_fault,
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+	.huge_fault = my_huge_fault,
+#endif
+};
+
+/* map the buffer to user space, all mappings share the same pages */
+int my_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	down_read(&resize_lock);
+	if (vma->vm_pgoff + (size >> PAGE_SHIFT) > my_size() >> PAGE_SHIFT) {
+		up_read(&resize_lock);
+		return -EINVAL;
+	}
+
+	/* private writable mappings copy pages on write, that needs struct
+	 * pages, the shared ones can use 2 MiB entries */
+	if (is_cow_mapping(vma->vm_flags)) {
+		vma->vm_ops = &my_vm_ops;
+	} else {
+		vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+		vma->vm_ops = &my_vm_pfn_ops;
+	}
+
+	/* count the mapping before resize can see it */
+	my_vma_open(vma);
+	up_read(&resize_lock);
+
+	return 0;
+}
+
 int my_open(struct inode *inode, struct file *filp)
 {
 	if ((filp->f_mode & FMODE_WRITE) != 0 &&
@@ -77,7 +445,7 @@ int my_open(struct inode *inode, struct file *filp)
 		return -EBUSY;
 	}
 
-	printk(KERN_INFO "Device opened.\n");
+	my_stat_add(opens, 1);
 	return 0;
 }
 
@@ -86,13 +454,13 @@ int my_release(struct inode *inode, struct file *filp)
 	if ((filp->f_mode & FMODE_WRITE) != 0)
 		atomic_set(&my_opened, 0);
 
-	printk(KERN_INFO "Closing device.\n");
 	return 0;
 }
 
 long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	uint32_t len;
+	uint64_t size;
 	/* check command number */
 	switch (cmd) {
 	case MY_SET_LEN:
@@ -108,6 +476,22 @@ long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				sizeof(len)) != 0)
 			return -EFAULT;
 	break;
+	case MY_SET_SIZE:
+		/* resizing changes the data, only the writer may do it */
+		if ((filp->f_mode & FMODE_WRITE) == 0)
+			return -EBADF;
+		if (copy_from_user(&size, (uint64_t *) arg,
+				sizeof(size)) != 0)
+			return -EFAULT;
+		return my_resize(size);
+	case MY_GET_SIZE:
+		down_read(&resize_lock);
+		size = my_size();
+		up_read(&resize_lock);
+		if (copy_to_user((uint64_t *) arg, &size,
+				sizeof(size)) != 0)
+			return -EFAULT;
+	break;
 	default:
 		return -EINVAL;
 	break;
@@ -118,11 +502,15 @@ long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 const struct file_operations myfops = {
 	.owner = THIS_MODULE,
-	.read = my_read,
+	.read_iter = my_read_iter,
 	.open = my_open,
-	.write = my_write,
+	.write_iter = my_write_iter,
+	.llseek = my_llseek,
 	.release = my_release,
 	.unlocked_ioctl = my_ioctl,
+	.mmap = my_mmap,
+	/* place shared mappings on 2 MiB boundaries for my_huge_fault */
+	.get_unmapped_area = thp_get_unmapped_area,
 };
 
 struct miscdevice mydevice = {
@@ -131,33 +519,80 @@ struct miscdevice mydevice = {
 	.fops = &myfops,
 };
 
+/* sum the per-CPU counters */
+static int my_stats_show(struct seq_file *m, void *v)
+{
+	struct my_stats sum = {}, *st;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&my_stats, cpu);
+		sum.reads += st->reads;
+		sum.writes += st->writes;
+		sum.read_bytes += st->read_bytes;
+		sum.write_bytes += st->write_bytes;
+		sum.short_reads += st->short_reads;
+		sum.short_writes += st->short_writes;
+		sum.lock_wait_ns += st->lock_wait_ns;
+		sum.opens += st->opens;
+	}
+
+	seq_printf(m, "reads: %llu\n", sum.reads);
+	seq_printf(m, "writes: %llu\n", sum.writes);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+	seq_printf(m, "short_reads: %llu\n", sum.short_reads);
+	seq_printf(m, "short_writes: %llu\n", sum.short_writes);
+	seq_printf(m, "lock_wait_ns: %llu\n", sum.lock_wait_ns);
+	seq_printf(m, "opens: %llu\n", sum.opens);
+	seq_printf(m, "buf_size: %llu\n", (unsigned long long) my_size());
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_stats);
+
 static int my_init(void)
 {
-	char str[100], *ptr;
+	char str[100];
+	unsigned long i, off;
+	int ret;
 
-	buf = vzalloc(BUF_SIZE);
-	if (buf == NULL)
-		return -ENOMEM;
+	ret = my_resize(buf_size);
+	if (ret != 0)
+		return ret;
 
 	/* write page virtual and physical address to every page */
-	for (ptr = buf; ptr < buf + BUF_SIZE; ptr += PAGE_SIZE) {
-		sprintf(str, "%p: %lx\n", ptr,
-			(unsigned long) vmalloc_to_pfn(ptr) << PAGE_SHIFT);
-		strcpy(ptr, str);
+	for (i = 0; i < chunk_count; i++) {
+		for (off = 0; off < CHUNK_SIZE; off += PAGE_SIZE) {
+			sprintf(str, "%p: %lx\n", chunks[i].virt + off,
+				(unsigned long) page_to_pfn(my_chunk_page(
+				&chunks[i], off)) << PAGE_SHIFT);
+			strcpy(chunks[i].virt + off, str);
+		}
 	}
 
+	my_debugfs = debugfs_create_dir("mydevice", NULL);
+	debugfs_create_file("stats", 0444, my_debugfs, NULL, &my_stats_fops);
+
 	misc_register(&mydevice);
 	printk(KERN_INFO "MY_SET_LEN: %u\n", MY_SET_LEN);
 	printk(KERN_INFO "MY_GET_LEN: %u\n", MY_GET_LEN);
+	printk(KERN_INFO "MY_SET_SIZE: %u\n", MY_SET_SIZE);
+	printk(KERN_INFO "MY_GET_SIZE: %u\n", MY_GET_SIZE);
 
 	return 0;
 }
 
 static void my_exit(void)
 {
+	unsigned long i;
+
 	misc_deregister(&mydevice);
+	debugfs_remove_recursive(my_debugfs);
 
-	vfree((void *) buf);
+	for (i = 0; i < chunk_count; i++)
+		my_free_chunk(&chunks[i]);
+	kvfree(chunks);
 }
 
 module_init(my_init);
@@ -12,20 +12,417 @@
 #include <linux/io.h>
 #include <linux/mm.h>
 #include <linux/kfifo.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/workqueue.h>
 
 
 #define MY_SET_LEN _IOW('t', 1, uint32_t)
 #define MY_GET_LEN _IOR('t', 2, uint64_t)
+#define MY_RING_WAKE _IO('t', 3)
+#define MY_SET_CHANNEL _IO('t', 4)
+#define MY_GET_CHANNEL _IOR('t', 5, uint32_t)
+#define MY_RECV_RECORDS _IOWR('t', 6, struct my_recv)
 #define BUF_SIZE 8192
+#define STAGE_SIZE 512
+#define STAGE_DELAY 1 /* jiffies staged data waits for more before publishing */
+#define POLL_ROOM (BUF_SIZE / 2) /* free space poll needs in record mode */
+#define RING_SIZE 65536 /* data part of the shared ring, power of two */
+
+/* allow more writers at once, each one stages data and publishes in batches */
+static bool multi_writer;
+module_param(multi_writer, bool, 0444);
+MODULE_PARM_DESC(multi_writer, "Allow multiple writers with batched publishing");
+
+static unsigned int max_channels = 1024;
+module_param(max_channels, uint, 0444);
+MODULE_PARM_DESC(max_channels, "Maximal number of independent channels");
+
+/* keep message boundaries, every write is one record and every read
+ * returns at most one record */
+static bool record;
+module_param(record, bool, 0444);
+MODULE_PARM_DESC(record, "Record framed channels instead of byte streams");
+
+/* one record for MY_RECV_RECORDS, len is the size of buf on input and the
+ * length of the record on output (it may be larger, the rest is lost) */
+struct my_rec {
+	uint64_t buf;
+	uint32_t len;
+	uint32_t pad;
+};
+
+/* argument of MY_RECV_RECORDS, count is updated to the number of records */
+struct my_recv {
+	uint64_t recs;
+	uint32_t count;
+	uint32_t pad;
+};
 
 atomic_t my_len = ATOMIC_INIT(BUF_SIZE);
-atomic_t my_opened = ATOMIC_INIT(0);
-DEFINE_MUTEX(lock);
-DECLARE_KFIFO(my_fifo, char, 8192);
+
+/* per-CPU counters, summed up when the debugfs file is read */
+struct my_stats {
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 short_reads;
+	u64 short_writes;
+	u64 lock_wait_ns;
+	u64 opens;
+};
+
+DEFINE_PER_CPU(struct my_stats, my_stats);
+struct dentry *my_debugfs;
+
+#define my_stat_add(field, val) this_cpu_add(my_stats.field, (val))
+
+/* take a fifo side lock and account the time spent waiting for it */
+static void my_mutex_lock(struct mutex *lock)
+{
+	u64 start = local_clock();
+
+	mutex_lock(lock);
+	my_stat_add(lock_wait_ns, local_clock() - start);
+}
+
+/* header of the shared ring, placed in the first mmaped page and followed by
+ * RING_SIZE bytes of data on the next page. head and tail run freely, data
+ * index is (head & (size - 1)). the producer writes data and then head, the
+ * consumer reads data and then writes tail. a side going to sleep in poll
+ * sets its *_wait flag first, the peer calls MY_RING_WAKE only when it
+ * finds the flag set, so no syscall is needed while both sides are busy */
+struct my_ring {
+	uint32_t head;
+	uint32_t prod_wait;
+	uint32_t pad1[14];	/* keep producer and consumer cachelines apart */
+	uint32_t tail;
+	uint32_t cons_wait;
+	uint32_t pad2[14];
+	uint32_t size;
+};
+
+/* one independent pipeline, every file is attached to one channel */
+struct my_channel {
+	unsigned int id;
+	/* both have the same layout, generic kfifo macros work with fifo */
+	union {
+		struct kfifo fifo;
+		struct kfifo_rec_ptr_2 rec;
+	};
+	/* kfifo is safe for one reader and one writer without locking, so
+	 * readers serialize only with readers and writers only with writers */
+	struct mutex read_mutex;
+	struct mutex write_mutex;
+	/* readers sleep here while the fifo is empty, writers while it is full */
+	wait_queue_head_t read_wait;
+	wait_queue_head_t write_wait;
+	/* the channel is opened for writing (unless multi_writer is set) */
+	atomic_t opened;
+	/* fifo space promised to the stages of multi_writer files, staged
+	 * bytes are acknowledged only when they are sure to fit */
+	atomic_t reserved;
+	/* highest fifo occupancy seen so far */
+	unsigned int peak;
+	/* shared ring for zero copy transfers, allocated on the first mmap */
+	struct my_ring *ring;
+	/* sleepers on the shared ring, woken up by MY_RING_WAKE */
+	wait_queue_head_t ring_wait;
+};
+
+/* channels are created on demand and live until the module is removed */
+struct my_channel **channels;
+DEFINE_MUTEX(channels_mutex);
+
+/* per open file data */
+struct my_file {
+	struct my_channel *chan;
+	/* file holds the writer slot of chan, taken on the first write or
+	 * mmap so that MY_SET_CHANNEL can pick the channel first */
+	bool writer;
+	/* file has mapped the ring, poll reports the ring state */
+	bool ring;
+	/* staging buffer of a writer in multi_writer mode, NULL otherwise */
+	char *stage;
+	unsigned int staged;
+	struct mutex stage_lock;
+	/* publishes what is left in the stage when no write comes soon */
+	struct delayed_work stage_work;
+};
+
+static void my_note_len(struct my_channel *ch)
+{
+	unsigned int len = kfifo_len(&ch->fifo);
+
+	if (len > ch->peak)
+		ch->peak = len;
+}
+
+/* find the channel or create it */
+static struct my_channel *my_get_channel(unsigned int id)
+{
+	struct my_channel *ch;
+
+	if (id >= max_channels)
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&channels_mutex);
+	ch = channels[id];
+	if (ch != NULL) {
+		mutex_unlock(&channels_mutex);
+		return ch;
+	}
+
+	ch = kzalloc(sizeof(*ch), GFP_KERNEL);
+	if (ch == NULL) {
+		mutex_unlock(&channels_mutex);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	if ((record ? kfifo_alloc(&ch->rec, BUF_SIZE, GFP_KERNEL) :
+			kfifo_alloc(&ch->fifo, BUF_SIZE, GFP_KERNEL)) != 0) {
+		kfree(ch);
+		mutex_unlock(&channels_mutex);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ch->id = id;
+	mutex_init(&ch->read_mutex);
+	mutex_init(&ch->write_mutex);
+	init_waitqueue_head(&ch->read_wait);
+	init_waitqueue_head(&ch->write_wait);
+	init_waitqueue_head(&ch->ring_wait);
+	atomic_set(&ch->opened, 0);
+
+	channels[id] = ch;
+	mutex_unlock(&channels_mutex);
+
+	return ch;
+}
+
+/* blocked readers and writers wait exclusively, so this wakes the pollers
+ * and one of them, who passes the wakeup on if there is more to do */
+static void my_wake(wait_queue_head_t *wq)
+{
+	if (wq_has_sleeper(wq))
+		wake_up_interruptible(wq);
+}
+
+/* writer has to wait, a record has to fit as a whole */
+static bool my_no_room(struct my_channel *ch, unsigned int count)
+{
+	if (record)
+		return kfifo_avail(&ch->rec) < count;
+	return kfifo_is_full(&ch->fifo);
+}
+
+/* poll reports room for writing. a record has to fit as a whole and its
+ * size is not known yet, so record mode waits until half of the fifo is
+ * free: records up to POLL_ROOM bytes then never fail with -EAGAIN,
+ * larger ones may */
+static bool my_poll_room(struct my_channel *ch)
+{
+	if (record)
+		return kfifo_avail(&ch->rec) >= POLL_ROOM;
+	return !kfifo_is_full(&ch->fifo);
+}
+
+static void my_free_channel(struct my_channel *ch)
+{
+	vfree(ch->ring);
+	kfifo_free(&ch->fifo);
+	kfree(ch);
+}
+
+/* reserve the writer slot of the channel */
+static int my_claim_writer(struct file *filp, struct my_channel *ch)
+{
+	if (!multi_writer && (filp->f_mode & FMODE_WRITE) != 0 &&
+			atomic_add_unless(&ch->opened, 1, 1) == 0) {
+		printk(KERN_INFO "Channel %u is already opened for writing.\n",
+			ch->id);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static void my_release_writer(struct file *filp, struct my_channel *ch)
+{
+	if (!multi_writer && (filp->f_mode & FMODE_WRITE) != 0)
+		atomic_set(&ch->opened, 0);
+}
+
+/* reserve the writer slot of the channel the file is on, once */
+static int my_get_writer(struct file *filp, struct my_file *mf)
+{
+	int ret = 0;
+
+	if (READ_ONCE(mf->writer))
+		return 0;
+
+	mutex_lock(&mf->stage_lock);
+	if (!mf->writer) {
+		ret = my_claim_writer(filp, mf->chan);
+		if (ret == 0)
+			WRITE_ONCE(mf->writer, true);
+	}
+	mutex_unlock(&mf->stage_lock);
+
+	return ret;
+}
+
+/* fifo space not promised to any stage yet, the readers only add to it */
+static int my_reservable(struct my_channel *ch)
+{
+	return (int) kfifo_avail(&ch->fifo) - atomic_read(&ch->reserved);
+}
+
+/* promise up to want bytes of fifo space to a stage, returns how many */
+static unsigned int my_reserve(struct my_channel *ch, unsigned int want)
+{
+	int old = atomic_read(&ch->reserved), got;
+
+	/* a publish fills the fifo before it drops its reservation, so the
+	 * space may be counted twice for a while but never promised twice */
+	do {
+		got = (int) kfifo_avail(&ch->fifo) - old;
+		if (got <= 0)
+			return 0;
+		got = min_t(int, got, want);
+	} while (!atomic_try_cmpxchg(&ch->reserved, &old, old + got));
+
+	return got;
+}
+
+/* move staged data to the fifo, the space is reserved so all of it fits
+ * (stage_lock held) */
+static void my_publish(struct my_file *mf)
+{
+	struct my_channel *ch = mf->chan;
+	unsigned int done;
+
+	if (!mf->staged)
+		return;
+
+	my_mutex_lock(&ch->write_mutex);
+	done = kfifo_in(&ch->fifo, mf->stage, mf->staged);
+	my_note_len(ch);
+	mutex_unlock(&ch->write_mutex);
+	atomic_sub(done, &ch->reserved);
+
+	if (done)
+		my_wake(&ch->read_wait);
+
+	WARN_ON_ONCE(done != mf->staged);
+	mf->staged = 0;
+}
+
+/* the writer went quiet, do not keep its data from the readers */
+static void my_stage_work(struct work_struct *work)
+{
+	struct my_file *mf = container_of(to_delayed_work(work),
+		struct my_file, stage_work);
+
+	mutex_lock(&mf->stage_lock);
+	my_publish(mf);
+	mutex_unlock(&mf->stage_lock);
+}
+
+/* write through the staging buffer, no global lock unless publishing.
+ * only bytes with reserved fifo space are staged, so what write reports
+ * is always published, by a later write, the delayed work or close */
+static ssize_t my_write_staged(struct my_file *mf, const char __user *ptr,
+	size_t count, int nonblock)
+{
+	struct my_channel *ch;
+	unsigned int write;
+
+	/* MY_SET_CHANNEL moves the file under stage_lock */
+	mutex_lock(&mf->stage_lock);
+	ch = mf->chan;
+
+	/* a full stage goes out first, its space is reserved */
+	if (mf->staged == STAGE_SIZE)
+		my_publish(mf);
+
+	write = my_reserve(ch, min_t(size_t, count, STAGE_SIZE - mf->staged));
+	while (!write) {
+		/* let the readers see what we have before we sleep, they make
+		 * the room, the other stages are published by their work */
+		my_publish(mf);
+		mutex_unlock(&mf->stage_lock);
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible_exclusive(ch->write_wait,
+				my_reservable(ch) > 0))
+			return -ERESTARTSYS;
+		mutex_lock(&mf->stage_lock);
+		write = my_reserve(ch, min_t(size_t, count,
+			STAGE_SIZE - mf->staged));
+	}
+
+	/* there is room for more, pass the wakeup on */
+	if (my_reservable(ch) > 0)
+		my_wake(&ch->write_wait);
+
+	if (copy_from_user(mf->stage + mf->staged, ptr, write) != 0) {
+		atomic_sub(write, &ch->reserved);
+		mutex_unlock(&mf->stage_lock);
+		return -EFAULT;
+	}
+	mf->staged += write;
+
+	/* publish the batch when it is full or when readers ran out of data */
+	if (mf->staged == STAGE_SIZE || kfifo_is_empty(&ch->fifo))
+		my_publish(mf);
+	/* the rest goes out with the next batch or after a short delay */
+	if (mf->staged)
+		schedule_delayed_work(&mf->stage_work, STAGE_DELAY);
+
+	mutex_unlock(&mf->stage_lock);
+
+	my_stat_add(writes, 1);
+	my_stat_add(write_bytes, write);
+	if (write < count)
+		my_stat_add(short_writes, 1);
+
+	return write;
+}
+
+/* take the reader lock once there is something to read */
+static int my_read_lock(struct file *filp, struct my_channel *ch)
+{
+	/* serialize readers only, writers use the other end of the fifo */
+	my_mutex_lock(&ch->read_mutex);
+
+	/* sleep until there is something to read */
+	while (kfifo_is_empty(&ch->fifo)) {
+		mutex_unlock(&ch->read_mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible_exclusive(ch->read_wait,
+				!kfifo_is_empty(&ch->fifo)))
+			return -ERESTARTSYS;
+		my_mutex_lock(&ch->read_mutex);
+	}
+
+	return 0;
+}
 
 ssize_t my_read(struct file *filp, char __user *ptr, size_t count, loff_t *off)
 {
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch = mf->chan;
 	unsigned int read;
+	int ret;
 
 	if (!count)
 		return 0;
@@ -33,17 +430,33 @@ ssize_t my_read(struct file *filp, char __user *ptr, size_t count, loff_t *off)
 	if (count > BUF_SIZE)
 		count = BUF_SIZE;
 
-	/* lock before reading the buffer */
-	mutex_lock(&lock);
-
-	/* write from fifo to user */
-	if (kfifo_to_user(&my_fifo, ptr, count, &read) != 0) {
-		mutex_unlock(&lock);
+	ret = my_read_lock(filp, ch);
+	if (ret != 0)
+		return ret;
+
+	/* write from fifo to user, only one record in record mode */
+	if (record)
+		ret = kfifo_to_user(&ch->rec, ptr, count, &read);
+	else
+		ret = kfifo_to_user(&ch->fifo, ptr, count, &read);
+	if (ret != 0) {
+		mutex_unlock(&ch->read_mutex);
 		return -EFAULT;
 	}
 
 	/* unlock after reading the buffer */
-	mutex_unlock(&lock);
+	mutex_unlock(&ch->read_mutex);
+
+	/* there is free space now, let a writer know, and the next reader
+	 * if something is left */
+	my_wake(&ch->write_wait);
+	if (!kfifo_is_empty(&ch->fifo))
+		my_wake(&ch->read_wait);
+
+	my_stat_add(reads, 1);
+	my_stat_add(read_bytes, read);
+	if (read < count)
+		my_stat_add(short_reads, 1);
 
 	return read;
 }
@@ -51,52 +464,333 @@ ssize_t my_read(struct file *filp, char __user *ptr, size_t count, loff_t *off)
 ssize_t my_write(struct file *filp, const char __user *ptr, size_t count,
 	loff_t *off)
 {
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch;
 	unsigned int write;
+	int ret;
 
 	if (!count)
 		return 0;
 
+	ret = my_get_writer(filp, mf);
+	if (ret != 0)
+		return ret;
+	ch = READ_ONCE(mf->chan);
+
+	/* records are never split */
+	if (record && count > BUF_SIZE - 2)
+		return -EMSGSIZE;
+
 	if (count > BUF_SIZE)
 		count = BUF_SIZE;
 
-	/* lock lock before writing, we want some consistency... */
-	mutex_lock(&lock);
+	if (mf->stage != NULL)
+		return my_write_staged(mf, ptr, count,
+			filp->f_flags & O_NONBLOCK);
+
+	/* serialize writers only, readers use the other end of the fifo */
+	my_mutex_lock(&ch->write_mutex);
+
+	/* sleep until there is some free space */
+	while (my_no_room(ch, count)) {
+		mutex_unlock(&ch->write_mutex);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible_exclusive(ch->write_wait,
+				!my_no_room(ch, count)))
+			return -ERESTARTSYS;
+		my_mutex_lock(&ch->write_mutex);
+	}
 
-	/* write from user to fifo */
-	if (kfifo_from_user(&my_fifo, ptr, count, &write) != 0) {
-		mutex_unlock(&lock);
+	/* write from user to fifo, as one record in record mode */
+	if (record)
+		ret = kfifo_from_user(&ch->rec, ptr, count, &write);
+	else
+		ret = kfifo_from_user(&ch->fifo, ptr, count, &write);
+	if (ret != 0) {
+		mutex_unlock(&ch->write_mutex);
 		return -EFAULT;
 	}
+	my_note_len(ch);
 
 	/* no more work with buffer, free the lock */
-	mutex_unlock(&lock);
+	mutex_unlock(&ch->write_mutex);
+
+	/* there is new data, wake up a reader, and the next writer if there
+	 * is room left */
+	my_wake(&ch->read_wait);
+	if (!kfifo_is_full(&ch->fifo))
+		my_wake(&ch->write_wait);
+
+	my_stat_add(writes, 1);
+	my_stat_add(write_bytes, write);
+	if (write < count)
+		my_stat_add(short_writes, 1);
 
 	return write;
 }
 
+/* new files start on channel 0, MY_SET_CHANNEL moves them elsewhere. the
+ * writer slot is taken later, so opening never fails with -EBUSY and many
+ * writers can open and pick their channels at the same time */
 int my_open(struct inode *inode, struct file *filp)
 {
-	if ((filp->f_mode & FMODE_WRITE) != 0 &&
-			atomic_add_unless(&my_opened, 1, 1) == 0) {
-		printk(KERN_INFO "Device is already opened for writing.\n");
-		return -EBUSY;
+	struct my_channel *ch = channels[0];
+	struct my_file *mf;
+
+	mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+
+	/* more writers share the fifo lock, let them batch their data. records
+	 * are written as a whole, there is nothing to batch */
+	if (mf != NULL && multi_writer && !record &&
+			(filp->f_mode & FMODE_WRITE) != 0) {
+		mf->stage = kmalloc(STAGE_SIZE, GFP_KERNEL);
+		if (mf->stage == NULL) {
+			kfree(mf);
+			mf = NULL;
+		}
 	}
 
-	printk(KERN_INFO "Device opened.\n");
+	if (mf == NULL)
+		return -ENOMEM;
+
+	mf->chan = ch;
+	mutex_init(&mf->stage_lock);
+	INIT_DELAYED_WORK(&mf->stage_work, my_stage_work);
+	filp->private_data = mf;
+
+	my_stat_add(opens, 1);
+	return 0;
+}
+
+/* push the staged data out when the file is being closed, it has its
+ * space in the fifo so this never waits for the readers */
+int my_flush(struct file *filp, fl_owner_t id)
+{
+	struct my_file *mf = filp->private_data;
+
+	if (mf->stage == NULL)
+		return 0;
+
+	mutex_lock(&mf->stage_lock);
+	my_publish(mf);
+	mutex_unlock(&mf->stage_lock);
+
 	return 0;
 }
 
+int my_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+	return my_flush(filp, NULL);
+}
+
 int my_release(struct inode *inode, struct file *filp)
 {
-	if ((filp->f_mode & FMODE_WRITE) != 0)
-		atomic_set(&my_opened, 0);
+	struct my_file *mf = filp->private_data;
+
+	/* a write after flush (from another process sharing the file) may
+	 * have staged more, nothing is ever dropped */
+	cancel_delayed_work_sync(&mf->stage_work);
+	if (mf->stage != NULL)
+		my_publish(mf);
+	if (mf->writer)
+		my_release_writer(filp, mf->chan);
+
+	kfree(mf->stage);
+	kfree(mf);
+
+	return 0;
+}
+
+int my_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch = mf->chan;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	/* only the header page and the data may be mapped */
+	if (vma->vm_pgoff + (size >> PAGE_SHIFT) >
+			(PAGE_SIZE + RING_SIZE) >> PAGE_SHIFT)
+		return -EINVAL;
+
+	/* a writable mapping is the producer of the ring */
+	ret = my_get_writer(filp, mf);
+	if (ret != 0)
+		return ret;
+
+	/* header page and the data, vmalloc_user zeroes the memory */
+	mutex_lock(&channels_mutex);
+	if (ch->ring == NULL) {
+		ch->ring = vmalloc_user(PAGE_SIZE + RING_SIZE);
+		if (ch->ring != NULL)
+			ch->ring->size = RING_SIZE;
+	}
+	mutex_unlock(&channels_mutex);
+
+	if (ch->ring == NULL)
+		return -ENOMEM;
+
+	ret = remap_vmalloc_range(vma, ch->ring, vma->vm_pgoff);
+	if (ret != 0)
+		return ret;
+
+	mf->ring = true;
+	return 0;
+}
+
+/* state of the shared ring, indexes are written by user space */
+static unsigned int my_ring_poll(struct file *filp, struct my_channel *ch,
+	poll_table *wait)
+{
+	unsigned int mask = 0;
+	uint32_t head, tail;
+
+	poll_wait(filp, &ch->ring_wait, wait);
+
+	head = READ_ONCE(ch->ring->head);
+	tail = READ_ONCE(ch->ring->tail);
+
+	if (head != tail)
+		mask |= POLLIN | POLLRDNORM;
+	if (head - tail < RING_SIZE)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+unsigned int my_poll(struct file *filp, poll_table *wait)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch = mf->chan;
+	unsigned int mask = 0;
+
+	if (mf->ring)
+		return my_ring_poll(filp, ch, wait);
+
+	poll_wait(filp, &ch->read_wait, wait);
+	poll_wait(filp, &ch->write_wait, wait);
+
+	if (!kfifo_is_empty(&ch->fifo))
+		mask |= POLLIN | POLLRDNORM;
+	/* staging writers can accept data while fifo space can be reserved
+	 * for them, the others while it has room */
+	if (mf->stage != NULL ? my_reservable(ch) > 0 : my_poll_room(ch))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+/* move the file to another channel */
+static int my_set_channel(struct file *filp, unsigned int id)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch, *old;
+	int ret;
+
+	ch = my_get_channel(id);
+	if (IS_ERR(ch))
+		return PTR_ERR(ch);
+
+	mutex_lock(&mf->stage_lock);
+	old = mf->chan;
+	if (ch == old) {
+		mutex_unlock(&mf->stage_lock);
+		return 0;
+	}
+
+	/* the mapping and the staged data belong to the old channel */
+	my_publish(mf);
+	if (mf->ring || mf->staged) {
+		mutex_unlock(&mf->stage_lock);
+		return -EBUSY;
+	}
+
+	/* a file which wrote already moves its writer slot along */
+	ret = mf->writer ? my_claim_writer(filp, ch) : 0;
+	if (ret == 0) {
+		WRITE_ONCE(mf->chan, ch);
+		if (mf->writer)
+			my_release_writer(filp, old);
+	}
+	mutex_unlock(&mf->stage_lock);
+
+	return ret;
+}
+
+/* read many whole records in one call, like recvmmsg. sleeps only until
+ * the first record arrives, then takes what is available */
+static int my_recv_records(struct file *filp, struct my_recv __user *arg)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_channel *ch = mf->chan;
+	struct my_recv recv;
+	struct my_rec rec;
+	struct my_rec __user *recs;
+	unsigned int i, len, read;
+	size_t bytes = 0;
+	int ret;
+
+	if (!record)
+		return -EINVAL;
+
+	if (copy_from_user(&recv, arg, sizeof(recv)) != 0)
+		return -EFAULT;
+	if (!recv.count)
+		return 0;
+	recs = u64_to_user_ptr(recv.recs);
+
+	ret = my_read_lock(filp, ch);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < recv.count && !kfifo_is_empty(&ch->rec); i++) {
+		if (copy_from_user(&rec, &recs[i], sizeof(rec)) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+
+		len = kfifo_peek_len(&ch->rec);
+		if (kfifo_to_user(&ch->rec, u64_to_user_ptr(rec.buf),
+				min(rec.len, len), &read) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+
+		/* tell the real record length, the caller sees truncation.
+		 * the record is out of the fifo already, count it even when
+		 * its length can't be stored */
+		rec.len = len;
+		bytes += read;
+		if (put_user(rec.len, &recs[i].len) != 0) {
+			ret = -EFAULT;
+			i++;
+			break;
+		}
+	}
+
+	mutex_unlock(&ch->read_mutex);
+
+	if (i > 0)
+		my_wake(&ch->write_wait);
+	if (!kfifo_is_empty(&ch->rec))
+		my_wake(&ch->read_wait);
+
+	my_stat_add(reads, 1);
+	my_stat_add(read_bytes, bytes);
+
+	/* report the records which were taken even on error */
+	if (i == 0)
+		return ret;
+	if (put_user(i, &arg->count) != 0)
+		return -EFAULT;
 
-	printk(KERN_INFO "Closing device.\n");
 	return 0;
 }
 
 long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+	struct my_file *mf = filp->private_data;
 	uint32_t len;
 	/* check command number */
 	switch (cmd) {
@@ -113,6 +807,20 @@ long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				sizeof(len)) != 0)
 			return -EFAULT;
 	break;
+	case MY_RING_WAKE:
+		/* the peer has updated the ring, wake up the sleepers */
+		wake_up_interruptible(&mf->chan->ring_wait);
+	break;
+	case MY_RECV_RECORDS:
+		return my_recv_records(filp, (struct my_recv __user *) arg);
+	case MY_SET_CHANNEL:
+		return my_set_channel(filp, (unsigned int) arg);
+	case MY_GET_CHANNEL:
+		len = mf->chan->id;
+		if (copy_to_user((uint32_t *) arg, &len,
+				sizeof(len)) != 0)
+			return -EFAULT;
+	break;
 	default:
 		return -EINVAL;
 	break;
@@ -126,6 +834,10 @@ const struct file_operations myfops = {
 	.read = my_read,
 	.open = my_open,
 	.write = my_write,
+	.flush = my_flush,
+	.fsync = my_fsync,
+	.poll = my_poll,
+	.mmap = my_mmap,
 	.release = my_release,
 	.unlocked_ioctl = my_ioctl,
 };
@@ -136,20 +848,99 @@ struct miscdevice mydevice = {
 	.fops = &myfops,
 };
 
+/* sum the per-CPU counters */
+static int my_stats_show(struct seq_file *m, void *v)
+{
+	struct my_stats sum = {}, *st;
+	struct my_channel *ch;
+	unsigned int i, used = 0, len = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&my_stats, cpu);
+		sum.reads += st->reads;
+		sum.writes += st->writes;
+		sum.read_bytes += st->read_bytes;
+		sum.write_bytes += st->write_bytes;
+		sum.short_reads += st->short_reads;
+		sum.short_writes += st->short_writes;
+		sum.lock_wait_ns += st->lock_wait_ns;
+		sum.opens += st->opens;
+	}
+
+	seq_printf(m, "reads: %llu\n", sum.reads);
+	seq_printf(m, "writes: %llu\n", sum.writes);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+	seq_printf(m, "short_reads: %llu\n", sum.short_reads);
+	seq_printf(m, "short_writes: %llu\n", sum.short_writes);
+	seq_printf(m, "lock_wait_ns: %llu\n", sum.lock_wait_ns);
+	seq_printf(m, "opens: %llu\n", sum.opens);
+
+	/* occupancy of every channel in use */
+	mutex_lock(&channels_mutex);
+	for (i = 0; i < max_channels; i++) {
+		ch = channels[i];
+		if (ch == NULL)
+			continue;
+		used++;
+		len += kfifo_len(&ch->fifo);
+		seq_printf(m, "channel %u: fifo_len: %u fifo_peak: %u\n",
+			ch->id, kfifo_len(&ch->fifo), ch->peak);
+	}
+	mutex_unlock(&channels_mutex);
+
+	seq_printf(m, "channels: %u\n", used);
+	seq_printf(m, "fifo_len: %u\n", len);
+	seq_printf(m, "fifo_size: %u\n", BUF_SIZE);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_stats);
+
 static int my_init(void)
 {
-	INIT_KFIFO(my_fifo);
+	struct my_channel *ch;
+
+	if (max_channels == 0)
+		return -EINVAL;
+
+	channels = kcalloc(max_channels, sizeof(*channels), GFP_KERNEL);
+	if (channels == NULL)
+		return -ENOMEM;
+
+	/* channel 0 is where every file starts */
+	ch = my_get_channel(0);
+	if (IS_ERR(ch)) {
+		kfree(channels);
+		return PTR_ERR(ch);
+	}
+
+	my_debugfs = debugfs_create_dir("mydevice", NULL);
+	debugfs_create_file("stats", 0444, my_debugfs, NULL, &my_stats_fops);
 
 	misc_register(&mydevice);
 	printk(KERN_INFO "MY_SET_LEN: %u\n", MY_SET_LEN);
 	printk(KERN_INFO "MY_GET_LEN: %u\n", MY_GET_LEN);
+	printk(KERN_INFO "MY_RING_WAKE: %u\n", MY_RING_WAKE);
+	printk(KERN_INFO "MY_SET_CHANNEL: %u\n", MY_SET_CHANNEL);
+	printk(KERN_INFO "MY_GET_CHANNEL: %u\n", MY_GET_CHANNEL);
+	printk(KERN_INFO "MY_RECV_RECORDS: %u\n", MY_RECV_RECORDS);
 
 	return 0;
 }
 
 static void my_exit(void)
 {
+	unsigned int i;
+
 	misc_deregister(&mydevice);
+	debugfs_remove_recursive(my_debugfs);
+
+	for (i = 0; i < max_channels; i++)
+		if (channels[i] != NULL)
+			my_free_channel(channels[i]);
+	kfree(channels);
 }
 
 module_init(my_init);
@@ -1,109 +1,475 @@
 #include <linux/io.h>
 #include <linux/module.h>
 #include <linux/delay.h>
-#include <linux/list.h>
 #include <linux/pci.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/slab.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 
-/* structure in the list */
+#define EVENTS_SIZE 16384
+#define TABLE_ENTRIES 16384
+#define TABLE_MAGIC 0x70636974 /* "pcit" */
+#define TABLE_PRESENT 0x0001
+#define TABLE_INITIAL 0x0002
+
+#define MY_PCI_LOOKUP _IOWR('p', 1, struct my_pci_query)
+
+/* argument of MY_PCI_LOOKUP, domain/bus/devfn in, the rest out */
+struct my_pci_query {
+	uint32_t domain;
+	uint8_t bus;
+	uint8_t devfn;
+	uint16_t present;
+	uint16_t vendor;
+	uint16_t device;
+};
+
+/* header of the binary snapshot in /dev/pci_table. generation is odd while
+ * the table is being rebuilt, a reader copies the entries and compares the
+ * generation before and after, an unchanged even value means the copy is
+ * consistent and that nothing changed since the last poll */
+struct my_table_hdr {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t count;
+	uint32_t entry_size;
+	uint32_t max_entries;
+	uint32_t pad[11];
+};
+
+/* fixed layout entry of the snapshot, sorted by domain, bus and devfn */
+struct my_table_entry {
+	uint32_t domain;
+	uint8_t bus;
+	uint8_t devfn;
+	uint16_t flags;
+	uint16_t vendor;
+	uint16_t device;
+	uint32_t class;
+};
+
+/* entry of the device index, removed devices stay with present cleared */
 struct my_struct {
-	struct pci_dev *pdev;
-	struct list_head list;
+	struct rb_node node;
+	u64 key;
+	u16 vendor;
+	u16 device;
+	u32 class;
+	/* the device was there when the module was loaded */
+	bool initial;
+	bool present;
 };
 
-LIST_HEAD(device_list);
+/* index sorted by domain, bus, slot and function */
+struct rb_root device_index = RB_ROOT;
+DEFINE_MUTEX(index_lock);
+
+/* change feed, one text line per event, filled under index_lock */
+DEFINE_KFIFO(events, char, EVENTS_SIZE);
+DEFINE_MUTEX(events_read_lock);
+DECLARE_WAIT_QUEUE_HEAD(events_wait);
+unsigned long events_lost;
+
+/* the header followed by the entries, readable and mmapable by user space */
+struct my_table_hdr *table;
+
+static size_t my_table_size(void)
+{
+	return PAGE_ALIGN(sizeof(struct my_table_hdr) +
+		TABLE_ENTRIES * sizeof(struct my_table_entry));
+}
+
+static u64 my_key(int domain, u8 bus, u8 devfn)
+{
+	return ((u64) domain << 16) | (bus << 8) | devfn;
+}
+
+static u64 my_pdev_key(struct pci_dev *pdev)
+{
+	return my_key(pci_domain_nr(pdev->bus), pdev->bus->number,
+		pdev->devfn);
+}
 
 /* help function printing info about the device */
-static void print_dev(struct pci_dev *pdev)
+static void print_dev(struct my_struct *s)
 {
 	 printk(KERN_INFO "%.2x:%.2x.%.2x, vendor: %.4x, device %.4x\n",
-			pdev->bus->number, PCI_SLOT(pdev->devfn),
-			PCI_FUNC(pdev->devfn), pdev->vendor, pdev->device);
+			(unsigned int) (s->key >> 8) & 0xff,
+			PCI_SLOT(s->key & 0xff), PCI_FUNC(s->key & 0xff),
+			s->vendor, s->device);
 }
 
-static int my_init(void)
+static struct my_struct *my_find(u64 key)
 {
+	struct rb_node *n = device_index.rb_node;
 	struct my_struct *s;
-	struct pci_dev *pdev = NULL;
 
-	/* go over all pci devices */
-	while ((pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev))) {
-		/* allocate memory for list item */
-		s = kmalloc(sizeof(*s), GFP_KERNEL);
+	while (n) {
+		s = rb_entry(n, struct my_struct, node);
+		if (key < s->key)
+			n = n->rb_left;
+		else if (key > s->key)
+			n = n->rb_right;
+		else
+			return s;
+	}
+
+	return NULL;
+}
+
+static void my_insert(struct my_struct *new)
+{
+	struct rb_node **n = &device_index.rb_node, *parent = NULL;
+	struct my_struct *s;
+
+	while (*n) {
+		parent = *n;
+		s = rb_entry(parent, struct my_struct, node);
+		n = new->key < s->key ? &parent->rb_left : &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, n);
+	rb_insert_color(&new->node, &device_index);
+}
 
-		/* just stop looping on error. */
+/* queue an event line for the readers (index_lock held) */
+static void my_event(const char *what, struct my_struct *s)
+{
+	char line[64];
+	int len;
+
+	len = snprintf(line, sizeof(line), "%s %.4x:%.2x:%.2x.%x %.4x:%.4x\n",
+		what, (unsigned int) (s->key >> 16),
+		(unsigned int) (s->key >> 8) & 0xff,
+		PCI_SLOT(s->key & 0xff), PCI_FUNC(s->key & 0xff),
+		s->vendor, s->device);
+
+	/* never block the bus, count what the readers missed */
+	if (kfifo_avail(&events) < len) {
+		events_lost++;
+		return;
+	}
+
+	kfifo_in(&events, line, len);
+	wake_up_interruptible(&events_wait);
+}
+
+/* rewrite the snapshot from the index (index_lock held) */
+static void my_table_update(void)
+{
+	struct my_table_entry *e = (struct my_table_entry *) (table + 1);
+	struct my_struct *s;
+	struct rb_node *n;
+	uint32_t count = 0;
+
+	WRITE_ONCE(table->generation, table->generation + 1);
+	smp_wmb();
+
+	for (n = rb_first(&device_index); n && count < TABLE_ENTRIES;
+			n = rb_next(n), count++, e++) {
+		s = rb_entry(n, struct my_struct, node);
+		e->domain = s->key >> 16;
+		e->bus = (s->key >> 8) & 0xff;
+		e->devfn = s->key & 0xff;
+		e->flags = (s->present ? TABLE_PRESENT : 0) |
+			(s->initial ? TABLE_INITIAL : 0);
+		e->vendor = s->vendor;
+		e->device = s->device;
+		e->class = s->class;
+	}
+	table->count = count;
+
+	smp_wmb();
+	WRITE_ONCE(table->generation, table->generation + 1);
+}
+
+/* add the device or mark it present again */
+static void my_add(struct pci_dev *pdev, bool initial)
+{
+	struct my_struct *s;
+
+	mutex_lock(&index_lock);
+	s = my_find(my_pdev_key(pdev));
+	if (s == NULL) {
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		/* just skip the device on error */
 		if (s == NULL) {
-			pci_dev_put(pdev);
-			break;
+			mutex_unlock(&index_lock);
+			return;
 		}
+		s->key = my_pdev_key(pdev);
+		s->initial = initial;
+		my_insert(s);
+	}
+
+	s->vendor = pdev->vendor;
+	s->device = pdev->device;
+	s->class = pdev->class;
+	s->present = true;
 
-		/* add the item to the list */
-		pci_dev_get(pdev);
-		s->pdev = pdev;
-		list_add(&s->list, &device_list);
+	/* the initial scan updates the table once at its end */
+	if (!initial) {
+		my_event("add", s);
+		my_table_update();
 	}
+	mutex_unlock(&index_lock);
+}
+
+static void my_del(struct pci_dev *pdev)
+{
+	struct my_struct *s;
+
+	mutex_lock(&index_lock);
+	s = my_find(my_pdev_key(pdev));
+	if (s != NULL && s->present) {
+		s->present = false;
+		my_event("remove", s);
+		my_table_update();
+	}
+	mutex_unlock(&index_lock);
+}
+
+/* keep the index current as devices come and go */
+static int my_notify(struct notifier_block *nb, unsigned long action,
+	void *data)
+{
+	struct pci_dev *pdev = to_pci_dev((struct device *) data);
+
+	switch (action) {
+	case BUS_NOTIFY_ADD_DEVICE:
+		my_add(pdev, false);
+	break;
+	case BUS_NOTIFY_DEL_DEVICE:
+		my_del(pdev);
+	break;
+	}
+
+	return NOTIFY_OK;
+}
+
+struct notifier_block my_nb = {
+	.notifier_call = my_notify,
+};
+
+static ssize_t my_read(struct file *filp, char __user *buf, size_t count,
+		loff_t *off)
+{
+	unsigned int read;
+
+	if (!count)
+		return 0;
+
+	mutex_lock(&events_read_lock);
+
+	/* sleep until an event arrives */
+	while (kfifo_is_empty(&events)) {
+		mutex_unlock(&events_read_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(events_wait,
+				!kfifo_is_empty(&events)))
+			return -ERESTARTSYS;
+		mutex_lock(&events_read_lock);
+	}
+
+	if (kfifo_to_user(&events, buf, count, &read) != 0) {
+		mutex_unlock(&events_read_lock);
+		return -EFAULT;
+	}
+	mutex_unlock(&events_read_lock);
+
+	return read;
+}
+
+static unsigned int my_poll(struct file *filp, poll_table *wait)
+{
+	poll_wait(filp, &events_wait, wait);
+
+	if (!kfifo_is_empty(&events))
+		return POLLIN | POLLRDNORM;
 
 	return 0;
 }
 
-/* this function loops simultaneously through both stored and current
-pci device list. both lists are sorted by domain, bus, slot and function
-(at least it appears that it is always so). */
-static void my_exit(void)
+static long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct my_pci_query q;
+	struct my_struct *s;
+
+	if (cmd != MY_PCI_LOOKUP)
+		return -EINVAL;
+
+	if (copy_from_user(&q, (void __user *) arg, sizeof(q)) != 0)
+		return -EFAULT;
+
+	mutex_lock(&index_lock);
+	s = my_find(my_key(q.domain, q.bus, q.devfn));
+	if (s == NULL) {
+		mutex_unlock(&index_lock);
+		return -ENODEV;
+	}
+	q.present = s->present;
+	q.vendor = s->vendor;
+	q.device = s->device;
+	mutex_unlock(&index_lock);
+
+	if (copy_to_user((void __user *) arg, &q, sizeof(q)) != 0)
+		return -EFAULT;
+
+	return 0;
+}
+
+static const struct file_operations my_fops = {
+	.owner = THIS_MODULE,
+	.read = my_read,
+	.poll = my_poll,
+	.unlocked_ioctl = my_ioctl,
+};
+
+static struct miscdevice my_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.fops = &my_fops,
+	.name = "pci_events",
+};
+
+/* the snapshot is read only */
+static int my_table_open(struct inode *inode, struct file *filp)
+{
+	if (filp->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	return 0;
+}
+
+/* the whole table in one call, consistent since it is copied locked */
+static ssize_t my_table_read(struct file *filp, char __user *buf,
+		size_t count, loff_t *off)
+{
+	ssize_t ret;
+
+	mutex_lock(&index_lock);
+	ret = simple_read_from_buffer(buf, count, off, table,
+		sizeof(*table) + table->count *
+		sizeof(struct my_table_entry));
+	mutex_unlock(&index_lock);
+
+	return ret;
+}
+
+static int my_table_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff + (size >> PAGE_SHIFT) >
+			my_table_size() >> PAGE_SHIFT)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, table, vma->vm_pgoff);
+}
+
+static const struct file_operations my_table_fops = {
+	.owner = THIS_MODULE,
+	.open = my_table_open,
+	.read = my_table_read,
+	.mmap = my_table_mmap,
+	.llseek = default_llseek,
+};
+
+static struct miscdevice my_misc_table = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.fops = &my_table_fops,
+	.name = "pci_table",
+};
+
+/* free the index, nobody adds to it any more */
+static void my_free_index(void)
 {
 	struct my_struct *s, *s1;
+
+	rbtree_postorder_for_each_entry_safe(s, s1, &device_index, node)
+		kfree(s);
+	device_index = RB_ROOT;
+}
+
+static int my_init(void)
+{
 	struct pci_dev *pdev = NULL;
+	int ret;
 
-	/* get first current item */
-	pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev);
-
-	/* loop over stored list */
-	list_for_each_entry_safe_reverse(s, s1, &device_list, list) {
-		/* while current item is < than stored, print it and try next */
-		/* this is most ugly and unreadable and deserves own function */
-		while (pdev &&
-			((pci_domain_nr(pdev->bus) <
-			pci_domain_nr(s->pdev->bus)) ||
-			(pci_domain_nr(pdev->bus) <=
-			pci_domain_nr(s->pdev->bus) &&
-			(pdev->bus->number < s->pdev->bus->number)) ||
-			((pci_domain_nr(pdev->bus) <=
-			pci_domain_nr(s->pdev->bus) &&
-			(pdev->bus->number <= s->pdev->bus->number)) &&
-			(PCI_SLOT(pdev->devfn) < PCI_SLOT(s->pdev->devfn))) ||
-			((pci_domain_nr(pdev->bus) <=
-			pci_domain_nr(s->pdev->bus) &&
-			(pdev->bus->number <= s->pdev->bus->number) &&
-			(PCI_SLOT(pdev->devfn) <=
-			PCI_SLOT(s->pdev->devfn)) &&
-			(PCI_FUNC(pdev->devfn) <
-			PCI_FUNC(s->pdev->devfn)))))) {
-
-			print_dev(pdev);
-			pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev);
-		}
+	/* zeroed memory which may be mapped to user space */
+	table = vmalloc_user(my_table_size());
+	if (table == NULL)
+		return -ENOMEM;
+	table->magic = TABLE_MAGIC;
+	table->entry_size = sizeof(struct my_table_entry);
+	table->max_entries = TABLE_ENTRIES;
 
-		/* when items are different, stored item is smaller */
-		if (!pdev ||
-			pci_domain_nr(s->pdev->bus) !=
-			pci_domain_nr(pdev->bus) ||
-			s->pdev->bus->number != pdev->bus->number ||
-			PCI_SLOT(s->pdev->devfn) != PCI_SLOT(pdev->devfn) ||
-			PCI_FUNC(s->pdev->devfn) != PCI_FUNC(pdev->devfn)) {
-
-			print_dev(s->pdev);
-		} else if (pdev) { /* otherwise increment current item */
-			pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev);
-		}
+	/* listen first so that no device slips between the scan and us */
+	ret = bus_register_notifier(&pci_bus_type, &my_nb);
+	if (ret != 0) {
+		vfree(table);
+		return ret;
+	}
 
-		/* always remove stored item fromthe list */
-		pci_dev_put(s->pdev);
-		list_del(&s->list);
-		kfree(s);
+	/* go over all pci devices */
+	while ((pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev)))
+		my_add(pdev, true);
+
+	mutex_lock(&index_lock);
+	my_table_update();
+	mutex_unlock(&index_lock);
+
+	ret = misc_register(&my_misc);
+	if (ret != 0) {
+		bus_unregister_notifier(&pci_bus_type, &my_nb);
+		vfree(table);
+		my_free_index();
+		return ret;
 	}
 
-	/* there still might be some new devices, print them */
-	while (pdev && (pdev = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, pdev)))
-		print_dev(pdev);
+	ret = misc_register(&my_misc_table);
+	if (ret != 0) {
+		misc_deregister(&my_misc);
+		bus_unregister_notifier(&pci_bus_type, &my_nb);
+		vfree(table);
+		my_free_index();
+		return ret;
+	}
+
+	return 0;
+}
+
+/* print the devices which were added or removed since the module was
+ * loaded and free the index */
+static void my_exit(void)
+{
+	struct my_struct *s;
+	struct rb_node *n;
+
+	misc_deregister(&my_misc_table);
+	misc_deregister(&my_misc);
+	bus_unregister_notifier(&pci_bus_type, &my_nb);
+	vfree(table);
+
+	/* in order of domain, bus, slot and function */
+	for (n = rb_first(&device_index); n; n = rb_next(n)) {
+		s = rb_entry(n, struct my_struct, node);
+		if (s->present != s->initial)
+			print_dev(s);
+	}
+
+	my_free_index();
+
+	if (events_lost)
+		printk(KERN_INFO "%lu events were lost\n", events_lost);
 }
 
 module_init(my_init);
@@ -2,8 +2,13 @@
 #include <linux/module.h>
 #include <linux/delay.h>
 #include <linux/pci.h>
-#include <linux/timer.h>
 #include <linux/interrupt.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
 
 #define VENDOR 0x18ec
 #define DEVICE 0xc058
@@ -14,44 +19,239 @@
 #define INT_RAISE(addr)		((addr)+0x0060)
 #define INT_ACK(addr)		((addr)+0x0064)
 
-#define TIMER_MSEC 100
+/* INT_RAISED bits */
+#define INT_SOFT		0x1000
+#define INT_ALL			INT_SOFT
 
-/* pointer to requested region (static, this will work only for one card!) */
-void *regionPtr;
+/* log2 buckets of the latency histogram, the last one takes the rest */
+#define LAT_BUCKETS 32
 
-static irqreturn_t my_handler(int irq, void *data, struct pt_regs *ptr)
+static unsigned int irq_rate = 10;
+module_param(irq_rate, uint, 0644);
+MODULE_PARM_DESC(irq_rate,
+	"doorbell interrupts raised per second and card, 0 stops raising");
+
+static unsigned int poll_rate = 20000;
+module_param(poll_rate, uint, 0644);
+MODULE_PARM_DESC(poll_rate,
+	"interrupts per second above which the card is polled, 0 never polls");
+
+static unsigned int poll_usecs = 50;
+module_param(poll_usecs, uint, 0644);
+MODULE_PARM_DESC(poll_usecs, "polling period in microseconds");
+
+static unsigned int poll_budget = 64;
+module_param(poll_budget, uint, 0644);
+MODULE_PARM_DESC(poll_budget, "most events handled by one poll");
+
+/* holder->flags bits */
+#define POLLING			0
+
+/* doorbell to handler latency, per CPU handling the interrupt */
+struct my_lat {
+	u64 count;
+	u64 sum_ns;
+	u64 max_ns;
+	u64 hist[LAT_BUCKETS];
+};
+
+/* combo/<pci name>/latency for each card */
+struct dentry *my_debugfs;
+
+/* state of one card, stored as the pci driver data */
+struct holder {
+	void *regionPtr;
+	/* doorbell generator, raised_ns is the time of the unhandled raise */
+	struct hrtimer gen_timer;
+	u64 raised_ns;
+	unsigned long overruns;
+	struct my_lat __percpu *lat;
+	struct dentry *debugfs;
+	/* interrupt coalescing */
+	unsigned long flags;
+	struct hrtimer poll_timer;
+	ktime_t window_start;
+	unsigned int window_irqs;
+	unsigned long irqs;
+	unsigned long polled;
+};
+
+/* ack the raised sources in mask, returns them */
+static u32 my_events(struct holder *holder, u32 mask)
 {
-	if (!printk_ratelimit()) {
-		printk(KERN_INFO "Combo IRQ: offset 0x0040: %x\n",
-			readl(INT_RAISED(regionPtr)));
+	u32 intr = readl(INT_RAISED(holder->regionPtr)) & mask;
+
+	if (intr)
+		writel(intr, INT_ACK(holder->regionPtr));
+
+	return intr;
+}
+
+/* count the interrupt, true when they come faster than poll_rate */
+static bool my_irq_rate(struct holder *holder)
+{
+	unsigned int rate = READ_ONCE(poll_rate);
+	ktime_t now;
+
+	if (!rate)
+		return false;
+
+	/* millisecond windows, racy with several vectors but only a hint */
+	now = ktime_get();
+	if (ktime_us_delta(now, holder->window_start) >= USEC_PER_MSEC) {
+		holder->window_start = now;
+		holder->window_irqs = 0;
 	}
 
-	if (readl(INT_RAISED(regionPtr))) {
-		writel(0x1000, INT_ACK(regionPtr));
-		return IRQ_HANDLED;
+	return ++holder->window_irqs > DIV_ROUND_UP(rate, MSEC_PER_SEC);
+}
+
+/* mask the card and poll it from a timer until it gets quiet */
+static void my_start_polling(struct holder *holder)
+{
+	if (test_and_set_bit(POLLING, &holder->flags))
+		return;
+
+	writel(0x0000, INT_ENABLE(holder->regionPtr));
+	hrtimer_start(&holder->poll_timer, us_to_ktime(READ_ONCE(poll_usecs)),
+		HRTIMER_MODE_REL_SOFT);
+}
+
+/* NAPI-like poll in softirq, at most poll_budget events per run */
+static enum hrtimer_restart my_poll(struct hrtimer *t)
+{
+	struct holder *holder = container_of(t, struct holder, poll_timer);
+	unsigned int budget = READ_ONCE(poll_budget), work;
+
+	for (work = 0; work < budget; work++)
+		if (!my_events(holder, INT_ALL))
+			break;
+	holder->polled += work;
+
+	/* polled doorbells measure the poll period, not the interrupt */
+	if (work)
+		WRITE_ONCE(holder->raised_ns, 0);
+
+	/* nothing for a whole period, back to interrupts, a source raised
+	 * meanwhile stays latched and fires as soon as it is enabled */
+	if (work == 0) {
+		clear_bit(POLLING, &holder->flags);
+		writel(INT_ALL, INT_ENABLE(holder->regionPtr));
+		return HRTIMER_NORESTART;
 	}
 
-	return IRQ_NONE;
+	hrtimer_forward_now(t, us_to_ktime(READ_ONCE(poll_usecs)));
+	return HRTIMER_RESTART;
 }
 
-static void my_func(unsigned long data);
-static DEFINE_TIMER(my_timer, my_func, 0, 30);
+/* account the latency of the doorbell handled at now */
+static void my_latency(struct holder *holder, u64 now)
+{
+	u64 raised = xchg(&holder->raised_ns, 0), ns;
+	struct my_lat *lat;
+
+	/* not raised by us or already handled */
+	if (!raised || now < raised)
+		return;
+
+	ns = now - raised;
+	lat = this_cpu_ptr(holder->lat);
+	lat->count++;
+	lat->sum_ns += ns;
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+	lat->hist[min_t(int, ns ? ilog2(ns) : 0, LAT_BUCKETS - 1)]++;
+}
 
-/* timer function */
-static void my_func(unsigned long data)
+static irqreturn_t my_handler(int irq, void *data)
 {
-	writel(0x1000, INT_RAISE(regionPtr));
-	mod_timer(&my_timer, jiffies + msecs_to_jiffies(TIMER_MSEC));
+	struct holder *holder = (struct holder *) data;
+	/* before touching the card, MMIO reads are slow */
+	u64 now = ktime_get_ns();
+	u32 intr;
+
+	/* the card is masked, whatever is raised is left to the poll */
+	if (test_bit(POLLING, &holder->flags))
+		return IRQ_NONE;
+
+	intr = my_events(holder, INT_ALL);
+	if (!intr)
+		return IRQ_NONE;
+
+	if (intr & INT_SOFT)
+		my_latency(holder, now);
+
+	holder->irqs++;
+	if (my_irq_rate(holder))
+		my_start_polling(holder);
+
+	return IRQ_HANDLED;
 }
 
+/* doorbell generator, each card has its own */
+static enum hrtimer_restart my_func(struct hrtimer *t)
+{
+	struct holder *holder = container_of(t, struct holder, gen_timer);
+	unsigned int rate = READ_ONCE(irq_rate);
+
+	if (rate) {
+		/* the previous doorbell was not handled yet */
+		if (xchg(&holder->raised_ns, ktime_get_ns()))
+			holder->overruns++;
+		/* writel orders the timestamp before the doorbell */
+		writel(INT_SOFT, INT_RAISE(holder->regionPtr));
+	}
+
+	/* a stopped generator checks the rate ten times a second */
+	hrtimer_forward_now(t, ns_to_ktime(rate ? NSEC_PER_SEC / rate :
+		NSEC_PER_SEC / 10));
+	return HRTIMER_RESTART;
+}
+
+static int my_latency_show(struct seq_file *m, void *v)
+{
+	struct holder *holder = m->private;
+	struct my_lat sum = {}, *lat;
+	u64 cpu_count;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		lat = per_cpu_ptr(holder->lat, cpu);
+		/* racy snapshot, the handlers keep counting */
+		cpu_count = READ_ONCE(lat->count);
+		if (cpu_count)
+			seq_printf(m, "cpu%d: %llu\n", cpu, cpu_count);
+		sum.count += cpu_count;
+		sum.sum_ns += READ_ONCE(lat->sum_ns);
+		sum.max_ns = max(sum.max_ns, READ_ONCE(lat->max_ns));
+		for (i = 0; i < LAT_BUCKETS; i++)
+			sum.hist[i] += READ_ONCE(lat->hist[i]);
+	}
+
+	seq_printf(m, "irq_rate: %u\n", READ_ONCE(irq_rate));
+	seq_printf(m, "count: %llu\n", sum.count);
+	seq_printf(m, "overruns: %lu\n", READ_ONCE(holder->overruns));
+	seq_printf(m, "mean_ns: %llu\n",
+		sum.count ? div64_u64(sum.sum_ns, sum.count) : 0);
+	seq_printf(m, "max_ns: %llu\n", sum.max_ns);
+	/* lower bound of each bucket in ns */
+	for (i = 0; i < LAT_BUCKETS; i++)
+		if (sum.hist[i])
+			seq_printf(m, "%llu: %llu\n", i ? 1ULL << i : 0,
+				sum.hist[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_latency);
 
 int my_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {	/* variable to hold read time field */
 	u32 time;
 	int ret;
+	struct holder *holder;
 
-	printk(KERN_INFO "Adding driver for device [%.4x:%.4x]\n",
-		VENDOR, DEVICE);
+	printk(KERN_INFO "Adding driver for device %s [%.4x:%.4x]\n",
+		pci_name(pdev), VENDOR, DEVICE);
 
 	/* enable device */
 	if (pci_enable_device(pdev) != 0)
@@ -63,59 +263,122 @@ int my_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		return -EIO;
 	}
 
-	/* remap region, undo previous actions on fail */
-	regionPtr = pci_ioremap_bar(pdev, REGION);
-	if (regionPtr == NULL) {
+	/* allocate the state of this card */
+	holder = kzalloc(sizeof(*holder), GFP_KERNEL);
+	if (holder == NULL) {
+		pci_release_region(pdev, REGION);
+		pci_disable_device(pdev);
+		return -ENOMEM;
+	}
+
+	holder->lat = alloc_percpu(struct my_lat);
+	if (holder->lat == NULL) {
+		kfree(holder);
+		pci_release_region(pdev, REGION);
 		pci_disable_device(pdev);
+		return -ENOMEM;
+	}
+
+	/* remap region, undo previous actions on fail */
+	holder->regionPtr = pci_ioremap_bar(pdev, REGION);
+	if (holder->regionPtr == NULL) {
+		free_percpu(holder->lat);
+		kfree(holder);
 		pci_release_region(pdev, REGION);
+		pci_disable_device(pdev);
 		return -EIO;
 	}
 
+	/* hard irq timer, a softirq one would add its own latency */
+	hrtimer_init(&holder->gen_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	holder->gen_timer.function = my_func;
+	hrtimer_init(&holder->poll_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL_SOFT);
+	holder->poll_timer.function = my_poll;
+	pci_set_drvdata(pdev, holder);
+
 	/* print physical memory address */
 	printk(KERN_INFO "Region %i phys addr: %lx\n", REGION,
 		(unsigned long) pci_resource_start(pdev, REGION));
 
 	/* read time data */
-	time = readl(regionPtr+4);
+	time = readl(holder->regionPtr+4);
 
 	/* print formatted time data */
 	printk(KERN_INFO "ID & revision: %.8x, %s %.4i/%.2i/%.2i %.2i:%.2i\n",
-		readl(regionPtr), "build time (YYYY/MM/DD hh:mm):",
+		readl(holder->regionPtr), "build time (YYYY/MM/DD hh:mm):",
 		((time & 0xF0000000) >> 28) + 2000, (time & 0x0F000000) >> 24,
 		(time & 0x00FF0000) >> 16, (time & 0x0000FF00) >> 8,
 		time & 0x000000FF);
 
 
-	/* setup IRQ */
-	ret = request_irq(pdev->irq, my_handler, IRQF_SHARED, "my_interrupt",
-		(void *) regionPtr);
+	/* setup IRQ, MSI-X or MSI when the card has it, else legacy */
+	pci_set_master(pdev);
+	ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_ALL_TYPES);
+	if (ret < 0) {
+		iounmap(holder->regionPtr);
+		free_percpu(holder->lat);
+		kfree(holder);
+		pci_release_region(pdev, REGION);
+		pci_disable_device(pdev);
+		return ret;
+	}
+
+	/* only the legacy interrupt may be shared with other devices */
+	ret = request_irq(pci_irq_vector(pdev, 0), my_handler,
+		pdev->msi_enabled || pdev->msix_enabled ? 0 : IRQF_SHARED,
+		"my_interrupt", (void *) holder);
 	if (ret != 0) {
 		printk(KERN_INFO "Cannot request irq\n");
-		pci_disable_device(pdev);
+		pci_free_irq_vectors(pdev);
+		iounmap(holder->regionPtr);
+		free_percpu(holder->lat);
+		kfree(holder);
 		pci_release_region(pdev, REGION);
+		pci_disable_device(pdev);
+		return ret;
 	}
 
 	/* allow interrupts in card */
-	writel(0x1000, INT_ENABLE(regionPtr));
+	writel(INT_ALL, INT_ENABLE(holder->regionPtr));
+
+	holder->debugfs = debugfs_create_dir(pci_name(pdev), my_debugfs);
+	debugfs_create_file("latency", 0444, holder->debugfs, holder,
+		&my_latency_fops);
 
 	/* start the timer */
-	mod_timer(&my_timer, jiffies);
+	hrtimer_start(&holder->gen_timer, 0, HRTIMER_MODE_REL);
 
 	return 0;
 }
 
 void my_remove(struct pci_dev *pdev)
 {
+	struct holder *holder = (struct holder *) pci_get_drvdata(pdev);
+
+	debugfs_remove_recursive(holder->debugfs);
+
 	/* stop the timer*/
-	del_timer_sync(&my_timer);
+	hrtimer_cancel(&holder->gen_timer);
+	/* disable interrupts in card */
+	writel(0x0000, INT_ENABLE(holder->regionPtr));
 	/* remove IRQ */
-	free_irq(pdev->irq, (void *) regionPtr);
+	free_irq(pci_irq_vector(pdev, 0), (void *) holder);
+	pci_free_irq_vectors(pdev);
+	/* no new interrupts, then stop polling, which may have enabled them */
+	hrtimer_cancel(&holder->poll_timer);
+	writel(0x0000, INT_ENABLE(holder->regionPtr));
 
-	printk(KERN_INFO "Removing driver for device [%.4x:%.4x]\n",
-		VENDOR, DEVICE);
+	printk(KERN_INFO "%lu interrupts, %lu events polled\n", holder->irqs,
+		holder->polled);
+
+	printk(KERN_INFO "Removing driver for device %s [%.4x:%.4x]\n",
+		pci_name(pdev), VENDOR, DEVICE);
 
 	/* unmap requested region */
-	iounmap(regionPtr);
+	iounmap(holder->regionPtr);
+	free_percpu(holder->lat);
+	kfree(holder);
 	/* release the region */
 	pci_release_region(pdev, REGION);
 	/* disable the device */
@@ -139,13 +402,21 @@ MODULE_DEVICE_TABLE(pci, my_table);
 
 static int my_init(void)
 {
-	return pci_register_driver(&my_pci_driver);
+	int ret;
+
+	my_debugfs = debugfs_create_dir("combo", NULL);
+
+	ret = pci_register_driver(&my_pci_driver);
+	if (ret != 0)
+		debugfs_remove_recursive(my_debugfs);
 
+	return ret;
 }
 
 static void my_exit(void)
 {
 	pci_unregister_driver(&my_pci_driver);
+	debugfs_remove_recursive(my_debugfs);
 }
 
 
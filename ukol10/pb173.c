@@ -6,6 +6,23 @@
 #include <linux/interrupt.h>
 #include <linux/dma-mapping.h>
 #include <linux/miscdevice.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/completion.h>
+#include <linux/uaccess.h>
+#include <linux/rwsem.h>
+#include <linux/poll.h>
+#include <linux/dmaengine.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
 
 #define VENDOR 0x18ec
 #define DEVICE 0xc058
@@ -21,91 +38,1557 @@
 #define DMA_COUNT(addr)		((addr)+0x0088)
 #define DMA_CMD(addr)		((addr)+0x008c)
 
+/* DMA_CMD bits, source and destination are DMA_HOST or DMA_CARD */
+#define DMA_CMD_RUN		0x1
+#define DMA_CMD_SRC(type)	((type) << 1)
+#define DMA_CMD_DST(type)	((type) << 4)
+#define DMA_CMD_NOIRQ		(0x1 << 7)
+#define DMA_CMD_ACK		(0x1 << 31)
+#define DMA_HOST		0x2
+#define DMA_CARD		0x4
+
+/* INT_RAISED bits */
+#define INT_DMA			0x0100
+#define INT_SOFT		0x1000
+#define INT_ALL			(INT_DMA | INT_SOFT)
+
+/* with MSI-X the card gets a vector per cause, but it has no register
+ * selecting which cause goes to which vector, so every vector handles all
+ * of them and the vectors only spread the interrupts over the CPUs */
+#define VEC_MISC		0
+#define VEC_DMA			1
+#define VEC_COUNT		2
+
 #define TIMER_MSEC 100
 
-/* pointer to requested region (static, this will work only for one card!) */
+static unsigned int poll_rate = 20000;
+module_param(poll_rate, uint, 0644);
+MODULE_PARM_DESC(poll_rate,
+	"interrupts per second above which the card is polled, 0 never polls");
+
+static unsigned int poll_usecs = 50;
+module_param(poll_usecs, uint, 0644);
+MODULE_PARM_DESC(poll_usecs, "polling period in microseconds");
+
+static unsigned int poll_budget = 64;
+module_param(poll_budget, uint, 0644);
+MODULE_PARM_DESC(poll_budget, "most events handled by one poll");
+
+static unsigned int ring_mb = 4;
+module_param(ring_mb, uint, 0444);
+MODULE_PARM_DESC(ring_mb, "size of the coherent DMA ring of a card in MiB");
+
+static unsigned int slot_size = 65536;
+module_param(slot_size, uint, 0444);
+MODULE_PARM_DESC(slot_size, "size of one ring slot in bytes");
+
+/* largest user buffer one MY_DMA_USER may pin */
+#define USER_DMA_MAX		(256 << 20)
+
+/* registered buffers per open file */
+#define DMA_BUFS		64
+
+/* failed dmaengine cookies remembered for tx_status */
+#define ERR_COOKIES		16
+
+#define MY_DMA_USER _IOW('t', 1, struct my_dma_user)
+#define MY_DMA_REGISTER _IOWR('t', 2, struct my_dma_reg)
+#define MY_DMA_UNREGISTER _IO('t', 3)
+#define MY_DMA_FIXED _IOW('t', 4, struct my_dma_fixed)
+#define MY_RING_FILL _IOW('t', 5, struct my_ring_fill)
+
+/* values of my_dma_user.dir */
+#define MY_DMA_TO_CARD		0
+#define MY_DMA_FROM_CARD	1
+
+/* argument of MY_DMA_USER, the card DMAs straight from/to addr */
+struct my_dma_user {
+	uint64_t addr;
+	uint64_t len;
+	/* address in the card memory */
+	uint32_t card;
+	uint32_t dir;
+};
+
+/* argument of MY_DMA_REGISTER, the index of the buffer is returned */
+struct my_dma_reg {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t index;
+	uint32_t pad;
+};
+
+/* argument of MY_DMA_FIXED, a range of a registered buffer */
+struct my_dma_fixed {
+	uint32_t index;
+	uint32_t card;
+	uint64_t offset;
+	uint64_t len;
+	uint32_t dir;
+	uint32_t pad;
+};
+
+/* argument of MY_RING_FILL, DMA len bytes of card memory to the next slot */
+struct my_ring_fill {
+	uint32_t card;
+	uint32_t len;
+};
+
+/* first page of the ring mapped to user space, slots follow it. The driver
+ * publishes filled slots by advancing head, user space consumes them in
+ * place and advances tail, both count up and wrap at 2^32 */
+struct my_ring_hdr {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t slots;
+	uint32_t slot_size;
+	/* offset of slot 0 from the start of the mapping */
+	uint32_t data_offset;
+	uint32_t pad[11];
+	/* bytes filled in each slot */
+	uint32_t lens[];
+};
+
+#define RING_DATA		PAGE_SIZE
+#define RING_MAX_SLOTS		((RING_DATA - sizeof(struct my_ring_hdr)) / \
+	sizeof(uint32_t))
+
+/* holder->flags bits */
+#define POLLING			0
+
+struct my_dma_req;
+typedef void (*my_dma_done_t)(struct my_dma_req *req);
+
+/* one transfer of the card DMA engine, owned by the submitter until done
+ * is called with status set, done runs in process context */
+struct my_dma_req {
+	struct list_head list;
+	u32 src;
+	u32 dst;
+	u32 count;
+	/* DMA_CMD_SRC() | DMA_CMD_DST() */
+	u32 cmd;
+	int status;
+	my_dma_done_t done;
+	void *data;
+};
+
+struct holder;
+
+/* the dmaengine channel of a card, the engine has just one */
+struct my_chan {
+	struct dma_chan chan;
+	struct holder *holder;
+	/* submitted descriptors waiting for issue_pending and completed ones
+	 * waiting for their ack, cookies are under the lock as well */
+	spinlock_t lock;
+	struct list_head submitted;
+	struct list_head completed;
+	struct dma_slave_config cfg;
+	/* the last cookies which completed with an error, tx_status reports
+	 * DMA_ERROR for them */
+	dma_cookie_t err_cookies[ERR_COOKIES];
+	unsigned int err_next;
+};
+
+/* dmaengine descriptor, one engine request per segment */
+struct my_desc {
+	struct dma_async_tx_descriptor txd;
+	struct list_head node;
+	struct my_chan *mc;
+	atomic_t left;
+	int status;
+	/* terminate_all was called, no callback (set under dma_lock) */
+	bool terminated;
+	int nreqs;
+	struct my_dma_req reqs[];
+};
+
+/* state of one card, stored as the pci driver data. Probe and every open
+ * file hold a reference, the files may outlive the card */
 struct holder {
+	struct kref ref;
+	struct pci_dev *pdev;
 	void *regionPtr;
+	/* the ring, my_ring_hdr followed by the slots */
 	dma_addr_t phys;
 	void *virt;
-	struct tasklet_struct *tasklet;
+	size_t ring_size;
+	/* the layout, the header only gets copies since user space may
+	 * write there, the kernel reads nothing but tail from it */
+	u32 ring_slots;
+	u32 ring_slot_size;
+	/* slots reserved by MY_RING_FILL and published to user space, each
+	 * slot has its request, free again once user space consumed it */
+	spinlock_t ring_lock;
+	u32 ring_next;
+	u32 ring_head;
+	struct my_dma_req *ring_reqs;
+	wait_queue_head_t ring_wait;
+	/* calls back the finished transfers */
+	struct work_struct done_work;
+	/* number of the allocated interrupt vectors, 1 or VEC_COUNT */
+	int nvec;
+	/* the vectors and the poll timer read and ack INT_RAISED under it */
+	spinlock_t event_lock;
+	/* transfers waiting for the engine, the one it runs and finished ones
+	 * waiting for their callbacks, all under dma_lock */
+	spinlock_t dma_lock;
+	struct list_head dma_pending;
+	struct my_dma_req *dma_active;
+	struct list_head dma_done;
+	bool dma_stopped;
+	wait_queue_head_t dma_idle;
+	/* interrupt coalescing */
+	unsigned long flags;
+	struct hrtimer poll_timer;
+	ktime_t window_start;
+	unsigned int window_irqs;
+	unsigned long irqs;
+	unsigned long polled;
+	/* the engine offered to other kernel users */
+	struct dma_device dma;
+	struct my_chan chan;
+	/* /dev/my_device<id> mapping the DMA memory of this card */
+	struct miscdevice misc;
+	char name[16];
+	int id;
+	/* set by remove, ioctls and poll hold dead_lock for reading so that
+	 * remove waits for them, the open files are on the files list, mmap
+	 * checks dead under files_lock */
+	struct rw_semaphore dead_lock;
+	bool dead;
+	struct mutex files_lock;
+	struct list_head files;
+};
+
+/* user buffer pinned and mapped for the card until unregistered, the
+ * pages are charged to RLIMIT_MEMLOCK of mm */
+struct my_dma_buf {
+	struct mm_struct *mm;
+	struct page **pages;
+	int nr_pages;
+	struct sg_table sgt;
+	u64 len;
+};
+
+/* open file of the card device, owns the registered buffers, transfers
+ * hold bufs_lock for reading so that a buffer in use cannot go away */
+struct my_file {
+	struct holder *holder;
+	struct file *filp;
+	struct list_head node;
+	struct rw_semaphore bufs_lock;
+	struct my_dma_buf *bufs[DMA_BUFS];
 };
 
-/* store the pointer to virt memory for misc device */
-void *miscPtr;
+/* numbers of the misc devices */
+static DEFINE_IDA(my_ida);
 
-static irqreturn_t my_handler(int irq, void *data, struct pt_regs *ptr)
+/* program the engine with the next pending transfer (dma_lock held) */
+static void my_dma_start(struct holder *holder)
 {
-	u32 intr = 0;
-	struct holder *holder = (struct holder *) data;
+	struct my_dma_req *req;
+
+	if (holder->dma_active || holder->dma_stopped ||
+			list_empty(&holder->dma_pending))
+		return;
+
+	req = list_first_entry(&holder->dma_pending, struct my_dma_req, list);
+	list_del(&req->list);
+	holder->dma_active = req;
+
+	writel(req->src, DMA_SRC(holder->regionPtr));
+	writel(req->dst, DMA_DST(holder->regionPtr));
+	writel(req->count, DMA_COUNT(holder->regionPtr));
+	writel(DMA_CMD_RUN | req->cmd, DMA_CMD(holder->regionPtr));
+}
 
-	if (printk_ratelimit()) {
-		printk(KERN_INFO "Combo IRQ: offset 0x0040: %x\n",
-			readl(INT_RAISED(holder->regionPtr)));
+/* queue the transfer, the engine runs them one by one in order */
+static int my_dma_submit(struct holder *holder, struct my_dma_req *req)
+{
+	unsigned long flags;
+
+	if (!req->count || !req->done)
+		return -EINVAL;
+
+	spin_lock_irqsave(&holder->dma_lock, flags);
+	if (holder->dma_stopped) {
+		spin_unlock_irqrestore(&holder->dma_lock, flags);
+		return -ESHUTDOWN;
 	}
+	list_add_tail(&req->list, &holder->dma_pending);
+	my_dma_start(holder);
+	spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+	return 0;
+}
+
+/* the engine finished, start the next transfer right away and leave the
+ * callback to the work item, queued on this CPU which the affinity of the
+ * DMA vector spreads among the cards */
+static void my_dma_complete(struct holder *holder)
+{
+	struct my_dma_req *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&holder->dma_lock, flags);
+	req = holder->dma_active;
+	holder->dma_active = NULL;
+	if (req) {
+		req->status = 0;
+		list_add_tail(&req->list, &holder->dma_done);
+	}
+	my_dma_start(holder);
+	/* stop waits for the idle engine, synchronize for the next request */
+	if (wq_has_sleeper(&holder->dma_idle))
+		wake_up(&holder->dma_idle);
+	spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+	queue_work(system_highpri_wq, &holder->done_work);
+}
+
+/* refuse new transfers, cancel the queued ones and wait for the running
+ * one, interrupts must still be enabled */
+static void my_dma_stop(struct holder *holder)
+{
+	struct my_dma_req *req, *tmp;
+	unsigned long flags;
+	LIST_HEAD(cancelled);
+
+	spin_lock_irqsave(&holder->dma_lock, flags);
+	holder->dma_stopped = true;
+	list_splice_init(&holder->dma_pending, &cancelled);
+	spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+	if (!wait_event_timeout(holder->dma_idle,
+			!READ_ONCE(holder->dma_active), HZ)) {
+		spin_lock_irqsave(&holder->dma_lock, flags);
+		req = holder->dma_active;
+		holder->dma_active = NULL;
+		spin_unlock_irqrestore(&holder->dma_lock, flags);
+		if (req) {
+			req->status = -ETIMEDOUT;
+			list_add_tail(&req->list, &cancelled);
+		}
+		wake_up(&holder->dma_idle);
+	}
+
+	list_for_each_entry_safe(req, tmp, &cancelled, list) {
+		list_del(&req->list);
+		if (req->status == 0)
+			req->status = -ECANCELED;
+		req->done(req);
+	}
+}
+
+/* handle the sources in mask which are raised, returns them */
+static u32 my_events(struct holder *holder, u32 mask)
+{
+	unsigned long flags;
+	u32 intr = 0;
+
+	/* one DMA completion must not be handled on two vectors at once */
+	spin_lock_irqsave(&holder->event_lock, flags);
 
 	/* read which interrupt arrived */
-	intr = readl(INT_RAISED(holder->regionPtr));
-	switch (intr) {
-	case 0x0100:
-		writel(0x1 << 31, DMA_CMD(holder->regionPtr));
-		writel(intr, INT_ACK(holder->regionPtr));
-		/* schedule the tasklet to write out the output */
-		tasklet_schedule(holder->tasklet);
-		return IRQ_HANDLED;
-	default: return IRQ_NONE;
+	intr = readl(INT_RAISED(holder->regionPtr)) & mask;
+	if (!intr) {
+		spin_unlock_irqrestore(&holder->event_lock, flags);
+		return 0;
+	}
+
+	if (intr & INT_DMA) {
+		writel(DMA_CMD_ACK, DMA_CMD(holder->regionPtr));
+		writel(INT_DMA, INT_ACK(holder->regionPtr));
+		my_dma_complete(holder);
+	}
+
+	if (intr & INT_SOFT)
+		writel(INT_SOFT, INT_ACK(holder->regionPtr));
+
+	spin_unlock_irqrestore(&holder->event_lock, flags);
+
+	return intr;
+}
+
+/* count the interrupt, true when they come faster than poll_rate */
+static bool my_irq_rate(struct holder *holder)
+{
+	unsigned int rate = READ_ONCE(poll_rate);
+	ktime_t now;
+
+	if (!rate)
+		return false;
+
+	/* millisecond windows, racy with several vectors but only a hint */
+	now = ktime_get();
+	if (ktime_us_delta(now, holder->window_start) >= USEC_PER_MSEC) {
+		holder->window_start = now;
+		holder->window_irqs = 0;
+	}
+
+	return ++holder->window_irqs > DIV_ROUND_UP(rate, MSEC_PER_SEC);
+}
+
+/* mask the card and poll it from a timer until it gets quiet */
+static void my_start_polling(struct holder *holder)
+{
+	if (test_and_set_bit(POLLING, &holder->flags))
+		return;
+
+	writel(0x0000, INT_ENABLE(holder->regionPtr));
+	hrtimer_start(&holder->poll_timer, us_to_ktime(READ_ONCE(poll_usecs)),
+		HRTIMER_MODE_REL_SOFT);
+}
+
+/* NAPI-like poll in softirq, at most poll_budget events per run */
+static enum hrtimer_restart my_poll(struct hrtimer *t)
+{
+	struct holder *holder = container_of(t, struct holder, poll_timer);
+	unsigned int budget = READ_ONCE(poll_budget), work;
+
+	for (work = 0; work < budget; work++)
+		if (!my_events(holder, INT_ALL))
+			break;
+	holder->polled += work;
+
+	/* nothing for a whole period, back to interrupts, a source raised
+	 * meanwhile stays latched and fires as soon as it is enabled */
+	if (work == 0) {
+		clear_bit(POLLING, &holder->flags);
+		writel(INT_ALL, INT_ENABLE(holder->regionPtr));
+		return HRTIMER_NORESTART;
 	}
+
+	hrtimer_forward_now(t, us_to_ktime(READ_ONCE(poll_usecs)));
+	return HRTIMER_RESTART;
 }
 
-void tasklet_func(unsigned long data)
+static irqreturn_t my_handle(struct holder *holder, u32 mask)
 {
-	printk(KERN_INFO "%s\n", ((char *) data)+20);
+	/* the card is masked, whatever is raised is left to the poll */
+	if (test_bit(POLLING, &holder->flags))
+		return IRQ_NONE;
+
+	if (!my_events(holder, mask))
+		return IRQ_NONE;
+
+	holder->irqs++;
+	if (my_irq_rate(holder))
+		my_start_polling(holder);
+
+	return IRQ_HANDLED;
 }
 
-struct page *my_nopage(struct vm_area_struct *vma, unsigned long address,
-	int *type)
+/* any vector, whatever cause the card signals on it */
+static irqreturn_t my_handler(int irq, void *data)
 {
-	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	struct page *page = NULL;
-	int offset_page;
+	return my_handle((struct holder *) data, INT_ALL);
+}
 
-	offset += address - vma->vm_start;
-	offset_page = offset / PAGE_SIZE;
+/* prefer MSI-X with a vector per source spread over the CPUs, fall back to
+ * a single MSI or legacy vector */
+static int my_request_irqs(struct pci_dev *pdev, struct holder *holder)
+{
+	struct irq_affinity affd = { };
+	int ret;
 
-	if (offset_page == 0)
-		page = virt_to_page(miscPtr);
+	holder->nvec = pci_alloc_irq_vectors_affinity(pdev, 1, VEC_COUNT,
+		PCI_IRQ_ALL_TYPES | PCI_IRQ_AFFINITY, &affd);
+	if (holder->nvec < 0)
+		return holder->nvec;
+
+	if (holder->nvec < VEC_COUNT) {
+		/* only the legacy interrupt may be shared with others */
+		ret = request_irq(pci_irq_vector(pdev, 0), my_handler,
+			pdev->msi_enabled || pdev->msix_enabled ?
+			0 : IRQF_SHARED, "my_interrupt", (void *) holder);
+		if (ret != 0)
+			goto err_vectors;
+		return 0;
+	}
 
-	if (!page)
-		return NOPAGE_SIGBUS;
+	ret = request_irq(pci_irq_vector(pdev, VEC_MISC), my_handler, 0,
+		"my_interrupt", (void *) holder);
+	if (ret != 0)
+		goto err_vectors;
 
-	get_page(page);
+	ret = request_irq(pci_irq_vector(pdev, VEC_DMA), my_handler, 0,
+		"my_dma", (void *) holder);
+	if (ret != 0) {
+		free_irq(pci_irq_vector(pdev, VEC_MISC), (void *) holder);
+		goto err_vectors;
+	}
 
-	if (type)
-		*type = VM_FAULT_MINOR;
+	return 0;
+
+err_vectors:
+	pci_free_irq_vectors(pdev);
+	return ret;
+}
 
-	return page;
+static void my_free_irqs(struct pci_dev *pdev, struct holder *holder)
+{
+	int i;
+
+	for (i = 0; i < holder->nvec; i++)
+		free_irq(pci_irq_vector(pdev, i), (void *) holder);
+	pci_free_irq_vectors(pdev);
 }
 
-struct vm_operations_struct vos = {
-	.nopage = &my_nopage,
+/* call back the finished transfers, including those finishing meanwhile,
+ * so one run drains whatever the engine completed */
+static void my_done_work(struct work_struct *work)
+{
+	struct holder *holder = container_of(work, struct holder, done_work);
+	struct my_dma_req *req, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	for (;;) {
+		spin_lock_irqsave(&holder->dma_lock, flags);
+		list_splice_init(&holder->dma_done, &done);
+		spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+		if (list_empty(&done))
+			break;
+
+		list_for_each_entry_safe(req, tmp, &done, list) {
+			list_del(&req->list);
+			req->done(req);
+		}
+		cond_resched();
+	}
+}
+
+/* shared by the transfers of one scatterlist */
+struct my_dma_wait {
+	atomic_t left;
+	int status;
+	struct completion done;
 };
 
-int my_mmap(struct file *filp, struct vm_area_struct *vma)
+static void my_sg_done(struct my_dma_req *req)
+{
+	struct my_dma_wait *wait = req->data;
+
+	if (req->status != 0)
+		wait->status = req->status;
+	if (atomic_dec_and_test(&wait->left))
+		complete(&wait->done);
+}
+
+/* transfer len bytes of the mapped scatterlist starting skip bytes into it
+ * to/from card memory at card, one queued request per DMA segment, and
+ * wait for all of them */
+static int my_dma_sg(struct holder *holder, struct sg_table *sgt, u64 skip,
+	u64 len, u32 card, bool to_card)
+{
+	struct my_dma_wait wait;
+	struct my_dma_req *reqs;
+	struct scatterlist *sg;
+	u32 cmd = to_card ? DMA_CMD_SRC(DMA_HOST) | DMA_CMD_DST(DMA_CARD) :
+		DMA_CMD_SRC(DMA_CARD) | DMA_CMD_DST(DMA_HOST);
+	u64 seg_len;
+	dma_addr_t addr;
+	int i, n = 0, ret;
+
+	reqs = kvcalloc(sgt->nents, sizeof(*reqs), GFP_KERNEL);
+	if (reqs == NULL)
+		return -ENOMEM;
+
+	for_each_sgtable_dma_sg(sgt, sg, i) {
+		seg_len = sg_dma_len(sg);
+		addr = sg_dma_address(sg);
+		if (skip >= seg_len) {
+			skip -= seg_len;
+			continue;
+		}
+		addr += skip;
+		seg_len = min(seg_len - skip, len);
+		skip = 0;
+
+		reqs[n].src = to_card ? addr : card;
+		reqs[n].dst = to_card ? card : addr;
+		reqs[n].count = seg_len;
+		reqs[n].cmd = cmd;
+		reqs[n].done = my_sg_done;
+		reqs[n].data = &wait;
+		n++;
+
+		card += seg_len;
+		len -= seg_len;
+		if (!len)
+			break;
+	}
+
+	/* the range does not fit in the scatterlist */
+	if (len) {
+		kvfree(reqs);
+		return -EINVAL;
+	}
+
+	atomic_set(&wait.left, n);
+	wait.status = 0;
+	init_completion(&wait.done);
+
+	for (i = 0; i < n; i++) {
+		ret = my_dma_submit(holder, &reqs[i]);
+		if (ret != 0) {
+			/* the rest is never queued, the queued ones finish */
+			wait.status = ret;
+			if (atomic_sub_and_test(n - i, &wait.left))
+				complete(&wait.done);
+			break;
+		}
+	}
+
+	/* the pages are the target of the DMA, no way to leave early */
+	if (n)
+		wait_for_completion(&wait.done);
+
+	kvfree(reqs);
+	return wait.status;
+}
+
+/* pin the user buffer, map it for the card and transfer it in place */
+static int my_dma_user(struct holder *holder, struct my_dma_user *u)
+{
+	bool to_card = u->dir == MY_DMA_TO_CARD;
+	enum dma_data_direction dir = to_card ? DMA_TO_DEVICE :
+		DMA_FROM_DEVICE;
+	unsigned long offset = offset_in_page(u->addr);
+	struct sg_table sgt;
+	struct page **pages;
+	int nr_pages, pinned, ret;
+
+	if (u->dir > MY_DMA_FROM_CARD || !u->len || u->len > USER_DMA_MAX ||
+			u->card + u->len > 1ULL << 32)
+		return -EINVAL;
+
+	nr_pages = DIV_ROUND_UP(offset + u->len, PAGE_SIZE);
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	/* the card writes the pages when it reads from its memory */
+	pinned = pin_user_pages_fast(u->addr - offset, nr_pages,
+		to_card ? 0 : FOLL_WRITE, pages);
+	if (pinned != nr_pages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		goto out_unpin;
+	}
+
+	ret = sg_alloc_table_from_pages(&sgt, pages, nr_pages, offset, u->len,
+		GFP_KERNEL);
+	if (ret != 0)
+		goto out_unpin;
+
+	ret = dma_map_sgtable(&holder->pdev->dev, &sgt, dir, 0);
+	if (ret != 0)
+		goto out_table;
+
+	ret = my_dma_sg(holder, &sgt, 0, u->len, u->card, to_card);
+
+	dma_unmap_sgtable(&holder->pdev->dev, &sgt, dir, 0);
+out_table:
+	sg_free_table(&sgt);
+out_unpin:
+	if (pinned > 0)
+		unpin_user_pages_dirty_lock(pages, pinned, !to_card);
+	kvfree(pages);
+	return ret;
+}
+
+static void my_buf_free(struct holder *holder, struct my_dma_buf *buf)
+{
+	dma_unmap_sgtable(&holder->pdev->dev, &buf->sgt, DMA_BIDIRECTIONAL, 0);
+	sg_free_table(&buf->sgt);
+	unpin_user_pages_dirty_lock(buf->pages, buf->nr_pages, true);
+	account_locked_vm(buf->mm, buf->nr_pages, false);
+	mmdrop(buf->mm);
+	kvfree(buf->pages);
+	kfree(buf);
+}
+
+/* pin and map the buffer once, both directions, for later MY_DMA_FIXED */
+static int my_buf_register(struct my_file *mf, struct my_dma_reg *r)
+{
+	struct holder *holder = mf->holder;
+	unsigned long offset = offset_in_page(r->addr);
+	struct my_dma_buf *buf;
+	int pinned, ret, i;
+
+	if (!r->len || r->len > USER_DMA_MAX)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	buf->len = r->len;
+	buf->nr_pages = DIV_ROUND_UP(offset + r->len, PAGE_SIZE);
+	buf->pages = kvmalloc_array(buf->nr_pages, sizeof(*buf->pages),
+		GFP_KERNEL);
+	if (buf->pages == NULL) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+
+	/* long term pins are locked memory, as for io_uring buffers */
+	ret = account_locked_vm(current->mm, buf->nr_pages, true);
+	if (ret != 0)
+		goto err_pages;
+	buf->mm = current->mm;
+	mmgrab(buf->mm);
+
+	pinned = pin_user_pages_fast(r->addr - offset, buf->nr_pages,
+		FOLL_WRITE | FOLL_LONGTERM, buf->pages);
+	if (pinned != buf->nr_pages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		goto err_unpin;
+	}
+
+	ret = sg_alloc_table_from_pages(&buf->sgt, buf->pages, buf->nr_pages,
+		offset, r->len, GFP_KERNEL);
+	if (ret != 0)
+		goto err_unpin;
+
+	ret = dma_map_sgtable(&holder->pdev->dev, &buf->sgt,
+		DMA_BIDIRECTIONAL, 0);
+	if (ret != 0)
+		goto err_table;
+
+	down_write(&mf->bufs_lock);
+	for (i = 0; i < DMA_BUFS; i++)
+		if (mf->bufs[i] == NULL)
+			break;
+	if (i == DMA_BUFS) {
+		up_write(&mf->bufs_lock);
+		my_buf_free(holder, buf);
+		return -ENOSPC;
+	}
+	mf->bufs[i] = buf;
+	up_write(&mf->bufs_lock);
+
+	r->index = i;
+	return 0;
+
+err_table:
+	sg_free_table(&buf->sgt);
+err_unpin:
+	if (pinned > 0)
+		unpin_user_pages(buf->pages, pinned);
+	account_locked_vm(buf->mm, buf->nr_pages, false);
+	mmdrop(buf->mm);
+err_pages:
+	kvfree(buf->pages);
+	kfree(buf);
+	return ret;
+}
+
+static int my_buf_unregister(struct my_file *mf, u32 index)
+{
+	struct my_dma_buf *buf;
+
+	if (index >= DMA_BUFS)
+		return -EINVAL;
+
+	down_write(&mf->bufs_lock);
+	buf = mf->bufs[index];
+	mf->bufs[index] = NULL;
+	up_write(&mf->bufs_lock);
+
+	if (buf == NULL)
+		return -ENOENT;
+
+	my_buf_free(mf->holder, buf);
+	return 0;
+}
+
+/* hand len bytes of the buffer starting skip bytes into it over to the
+ * device or back to the cpu. walk the cpu side entries, the DMA segments
+ * may be merged by an IOMMU and are not contiguous in physical memory,
+ * and sync the whole entries the transfer touches */
+static void my_buf_sync(struct device *dev, struct my_dma_buf *buf, u64 skip,
+	u64 len, enum dma_data_direction dir, bool for_device)
+{
+	struct scatterlist *sg;
+	u64 seg_len;
+	int i;
+
+	for_each_sgtable_sg(&buf->sgt, sg, i) {
+		seg_len = sg->length;
+		if (skip >= seg_len) {
+			skip -= seg_len;
+			continue;
+		}
+		seg_len = min(seg_len - skip, len);
+
+		if (for_device)
+			dma_sync_sg_for_device(dev, sg, 1, dir);
+		else
+			dma_sync_sg_for_cpu(dev, sg, 1, dir);
+
+		skip = 0;
+		len -= seg_len;
+		if (!len)
+			break;
+	}
+}
+
+/* transfer a range of a registered buffer, no pinning or mapping */
+static int my_dma_fixed(struct my_file *mf, struct my_dma_fixed *f)
+{
+	struct device *dev = &mf->holder->pdev->dev;
+	bool to_card = f->dir == MY_DMA_TO_CARD;
+	enum dma_data_direction dir = to_card ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	struct my_dma_buf *buf;
+	int ret;
+
+	if (f->index >= DMA_BUFS || f->dir > MY_DMA_FROM_CARD || !f->len ||
+			f->card + f->len > 1ULL << 32)
+		return -EINVAL;
+
+	down_read(&mf->bufs_lock);
+	buf = mf->bufs[f->index];
+	if (buf == NULL) {
+		up_read(&mf->bufs_lock);
+		return -ENOENT;
+	}
+	if (f->offset >= buf->len || f->len > buf->len - f->offset) {
+		up_read(&mf->bufs_lock);
+		return -EINVAL;
+	}
+
+	/* the mapping lives on, hand the range over to the card before every
+	 * transfer and back after it, whatever the direction */
+	my_buf_sync(dev, buf, f->offset, f->len, dir, true);
+	ret = my_dma_sg(mf->holder, &buf->sgt, f->offset, f->len, f->card,
+		to_card);
+	my_buf_sync(dev, buf, f->offset, f->len, dir, false);
+	up_read(&mf->bufs_lock);
+
+	return ret;
+}
+
+/* lay out the freshly allocated (zeroed) ring */
+static void my_ring_init(struct holder *holder)
+{
+	struct my_ring_hdr *hdr = holder->virt;
+
+	holder->ring_slot_size = slot_size;
+	holder->ring_slots = min_t(size_t,
+		(holder->ring_size - RING_DATA) / slot_size, RING_MAX_SLOTS);
+
+	hdr->slot_size = holder->ring_slot_size;
+	hdr->slots = holder->ring_slots;
+	hdr->data_offset = RING_DATA;
+
+	spin_lock_init(&holder->ring_lock);
+	init_waitqueue_head(&holder->ring_wait);
+}
+
+/* the engine runs the requests in order and MY_RING_FILL submits them in
+ * slot order under ring_lock, so slots complete in order */
+static void my_ring_done(struct my_dma_req *req)
+{
+	struct holder *holder = req->data;
+	struct my_ring_hdr *hdr = holder->virt;
+	u32 slot = req - holder->ring_reqs;
+
+	hdr->lens[slot] = req->status == 0 ? req->count : 0;
+
+	spin_lock(&holder->ring_lock);
+	holder->ring_head++;
+	/* the slot and its length before the index */
+	smp_store_release(&hdr->head, holder->ring_head);
+	spin_unlock(&holder->ring_lock);
+
+	wake_up_interruptible(&holder->ring_wait);
+}
+
+/* DMA from the card to the next free slot of the ring */
+static int my_ring_fill(struct holder *holder, struct my_ring_fill *f)
+{
+	struct my_ring_hdr *hdr = holder->virt;
+	struct my_dma_req *req;
+	u32 tail, slot;
+	int ret;
+
+	if (!f->len || f->len > holder->ring_slot_size ||
+			(u64) f->card + f->len > 1ULL << 32)
+		return -EINVAL;
+
+	/* reserve and submit under the lock, the slot order is the engine
+	 * order then */
+	spin_lock(&holder->ring_lock);
+	/* tail is written by user space, never trust it past head */
+	tail = READ_ONCE(hdr->tail);
+	if ((s32) (holder->ring_head - tail) < 0)
+		tail = holder->ring_head;
+	if (holder->ring_next - tail >= holder->ring_slots) {
+		spin_unlock(&holder->ring_lock);
+		return -ENOSPC;
+	}
+	slot = holder->ring_next % holder->ring_slots;
+
+	req = &holder->ring_reqs[slot];
+	req->src = f->card;
+	req->dst = holder->phys + RING_DATA + slot * holder->ring_slot_size;
+	req->count = f->len;
+	req->cmd = DMA_CMD_SRC(DMA_CARD) | DMA_CMD_DST(DMA_HOST);
+	req->done = my_ring_done;
+	req->data = holder;
+
+	/* the slot stays free when the card is going away */
+	ret = my_dma_submit(holder, req);
+	if (ret == 0)
+		holder->ring_next++;
+	spin_unlock(&holder->ring_lock);
+
+	return ret;
+}
+
+static struct my_chan *to_my_chan(struct dma_chan *chan)
+{
+	return container_of(chan, struct my_chan, chan);
+}
+
+/* free the completed descriptors the client is done with */
+static void my_desc_free_acked(struct my_chan *mc)
+{
+	struct my_desc *desc, *tmp;
+	unsigned long flags;
+	LIST_HEAD(acked);
+
+	spin_lock_irqsave(&mc->lock, flags);
+	list_for_each_entry_safe(desc, tmp, &mc->completed, node)
+		if (async_tx_test_ack(&desc->txd))
+			list_move_tail(&desc->node, &acked);
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	list_for_each_entry_safe(desc, tmp, &acked, node)
+		kfree(desc);
+}
+
+/* every request of a descriptor ends here, in order, the last one
+ * completes the cookie and calls the client back */
+static void my_desc_req_done(struct my_dma_req *req)
+{
+	struct my_desc *desc = req->data;
+	struct my_chan *mc = desc->mc;
+	struct dma_async_tx_descriptor *txd = &desc->txd;
+	struct dmaengine_result res = { };
+	unsigned long flags;
+
+	if (req->status != 0)
+		desc->status = req->status;
+	if (!atomic_dec_and_test(&desc->left))
+		return;
+
+	/* terminate_all completes the later descriptors of the channel
+	 * before the running one, the cookie never goes back */
+	spin_lock_irqsave(&mc->lock, flags);
+	if (dma_async_is_complete(txd->cookie, mc->chan.completed_cookie,
+			mc->chan.cookie) == DMA_IN_PROGRESS)
+		mc->chan.completed_cookie = txd->cookie;
+	if (desc->status)
+		mc->err_cookies[mc->err_next++ % ERR_COOKIES] = txd->cookie;
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	/* the client gave up on it, it may be gone already */
+	if (!READ_ONCE(desc->terminated)) {
+		res.result = desc->status ? DMA_TRANS_ABORTED :
+			DMA_TRANS_NOERROR;
+		if (txd->callback_result)
+			txd->callback_result(txd->callback_param, &res);
+		else if (txd->callback)
+			txd->callback(txd->callback_param);
+	}
+
+	if (async_tx_test_ack(txd)) {
+		kfree(desc);
+		return;
+	}
+
+	spin_lock_irqsave(&mc->lock, flags);
+	list_add_tail(&desc->node, &mc->completed);
+	spin_unlock_irqrestore(&mc->lock, flags);
+}
+
+static dma_cookie_t my_tx_submit(struct dma_async_tx_descriptor *txd)
+{
+	struct my_desc *desc = container_of(txd, struct my_desc, txd);
+	struct my_chan *mc = desc->mc;
+	dma_cookie_t cookie;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mc->lock, flags);
+	cookie = mc->chan.cookie + 1;
+	if (cookie < DMA_MIN_COOKIE)
+		cookie = DMA_MIN_COOKIE;
+	mc->chan.cookie = txd->cookie = cookie;
+	list_add_tail(&desc->node, &mc->submitted);
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	return cookie;
+}
+
+static struct my_desc *my_desc_alloc(struct my_chan *mc, int nreqs,
+	unsigned long flags)
+{
+	struct my_desc *desc;
+
+	my_desc_free_acked(mc);
+
+	desc = kzalloc(struct_size(desc, reqs, nreqs), GFP_NOWAIT);
+	if (desc == NULL)
+		return NULL;
+
+	dma_async_tx_descriptor_init(&desc->txd, &mc->chan);
+	desc->txd.tx_submit = my_tx_submit;
+	desc->txd.flags = flags;
+	desc->mc = mc;
+	desc->nreqs = nreqs;
+	atomic_set(&desc->left, nreqs);
+
+	return desc;
+}
+
+static void my_desc_req(struct my_desc *desc, int i, u32 src, u32 dst,
+	u32 count, u32 cmd)
+{
+	desc->reqs[i].src = src;
+	desc->reqs[i].dst = dst;
+	desc->reqs[i].count = count;
+	desc->reqs[i].cmd = cmd;
+	desc->reqs[i].done = my_desc_req_done;
+	desc->reqs[i].data = desc;
+}
+
+/* the engine counts in 32 bits and addresses are under the 32 bit mask */
+static struct dma_async_tx_descriptor *my_prep_memcpy(struct dma_chan *chan,
+	dma_addr_t dst, dma_addr_t src, size_t len, unsigned long flags)
+{
+	struct my_desc *desc;
+
+	if (!len || len > U32_MAX)
+		return NULL;
+
+	desc = my_desc_alloc(to_my_chan(chan), 1, flags);
+	if (desc == NULL)
+		return NULL;
+
+	my_desc_req(desc, 0, src, dst, len,
+		DMA_CMD_SRC(DMA_HOST) | DMA_CMD_DST(DMA_HOST));
+
+	return &desc->txd;
+}
+
+/* the slave side is card memory at the configured address, it advances
+ * with every segment */
+static struct dma_async_tx_descriptor *my_prep_slave_sg(struct dma_chan *chan,
+	struct scatterlist *sgl, unsigned int sg_len,
+	enum dma_transfer_direction dir, unsigned long flags, void *context)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	bool to_card = dir == DMA_MEM_TO_DEV;
+	struct scatterlist *sg;
+	struct my_desc *desc;
+	u64 card;
+	u32 cmd;
+	int i;
+
+	if (!sg_len || (dir != DMA_MEM_TO_DEV && dir != DMA_DEV_TO_MEM))
+		return NULL;
+
+	card = to_card ? mc->cfg.dst_addr : mc->cfg.src_addr;
+	cmd = to_card ? DMA_CMD_SRC(DMA_HOST) | DMA_CMD_DST(DMA_CARD) :
+		DMA_CMD_SRC(DMA_CARD) | DMA_CMD_DST(DMA_HOST);
+
+	desc = my_desc_alloc(mc, sg_len, flags);
+	if (desc == NULL)
+		return NULL;
+
+	for_each_sg(sgl, sg, sg_len, i) {
+		if (card + sg_dma_len(sg) > 1ULL << 32) {
+			kfree(desc);
+			return NULL;
+		}
+		if (to_card)
+			my_desc_req(desc, i, sg_dma_address(sg), card,
+				sg_dma_len(sg), cmd);
+		else
+			my_desc_req(desc, i, card, sg_dma_address(sg),
+				sg_dma_len(sg), cmd);
+		card += sg_dma_len(sg);
+	}
+
+	return &desc->txd;
+}
+
+static int my_config(struct dma_chan *chan, struct dma_slave_config *cfg)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	unsigned long flags;
+
+	spin_lock_irqsave(&mc->lock, flags);
+	mc->cfg = *cfg;
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	return 0;
+}
+
+/* hand the submitted descriptors to the engine queue, in cookie order
+ * since concurrent callers are serialized by the lock */
+static void my_issue_pending(struct dma_chan *chan)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	struct my_dma_req *req, *rtmp;
+	struct my_desc *desc, *tmp;
+	unsigned long flags;
+	LIST_HEAD(failed);
+	int i, n, ret;
+
+	spin_lock_irqsave(&mc->lock, flags);
+	list_for_each_entry_safe(desc, tmp, &mc->submitted, node) {
+		list_del(&desc->node);
+		/* the last request may complete and free an acked desc
+		 * before the loop looks at it again */
+		n = desc->nreqs;
+		for (i = 0; i < n; i++) {
+			req = &desc->reqs[i];
+			ret = my_dma_submit(mc->holder, req);
+			/* the card is going away, fail the rest once the lock
+			 * which the callback takes is dropped */
+			if (ret != 0) {
+				req->status = ret;
+				list_add_tail(&req->list, &failed);
+			}
+		}
+	}
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	list_for_each_entry_safe(req, rtmp, &failed, list) {
+		list_del(&req->list);
+		my_desc_req_done(req);
+	}
+}
+
+static enum dma_status my_tx_status(struct dma_chan *chan,
+	dma_cookie_t cookie, struct dma_tx_state *state)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	dma_cookie_t used, complete;
+	enum dma_status status;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&mc->lock, flags);
+	used = chan->cookie;
+	complete = chan->completed_cookie;
+	status = dma_async_is_complete(cookie, complete, used);
+	for (i = 0; status == DMA_COMPLETE && i < ERR_COOKIES; i++)
+		if (mc->err_cookies[i] == cookie)
+			status = DMA_ERROR;
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	dma_set_tx_state(state, complete, used, 0);
+	return status;
+}
+
+/* the request belongs to a descriptor of the channel */
+static bool my_chan_req(struct my_chan *mc, struct my_dma_req *req)
+{
+	return req != NULL && req->done == my_desc_req_done &&
+		((struct my_desc *) req->data)->mc == mc;
+}
+
+/* drop the descriptors not handed to the engine yet, fail the queued
+ * requests of the channel and silence the callbacks of the running and
+ * finished ones, device_synchronize waits for them */
+static int my_terminate_all(struct dma_chan *chan)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	struct holder *holder = mc->holder;
+	struct my_dma_req *req, *rtmp;
+	struct my_desc *desc, *tmp;
+	unsigned long flags;
+	LIST_HEAD(dropped);
+	LIST_HEAD(cancelled);
+
+	spin_lock_irqsave(&mc->lock, flags);
+	list_splice_init(&mc->submitted, &dropped);
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	list_for_each_entry_safe(desc, tmp, &dropped, node)
+		kfree(desc);
+
+	spin_lock_irqsave(&holder->dma_lock, flags);
+	list_for_each_entry_safe(req, rtmp, &holder->dma_pending, list) {
+		if (!my_chan_req(mc, req))
+			continue;
+		((struct my_desc *) req->data)->terminated = true;
+		req->status = -ECANCELED;
+		list_move_tail(&req->list, &cancelled);
+	}
+	if (my_chan_req(mc, holder->dma_active))
+		((struct my_desc *)
+			holder->dma_active->data)->terminated = true;
+	list_for_each_entry(req, &holder->dma_done, list)
+		if (my_chan_req(mc, req))
+			((struct my_desc *) req->data)->terminated = true;
+	spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+	list_for_each_entry_safe(req, rtmp, &cancelled, list) {
+		list_del(&req->list);
+		my_desc_req_done(req);
+	}
+
+	return 0;
+}
+
+/* the running request of the channel is done and no callback runs */
+static bool my_chan_idle(struct my_chan *mc)
+{
+	struct holder *holder = mc->holder;
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&holder->dma_lock, flags);
+	idle = !my_chan_req(mc, holder->dma_active);
+	spin_unlock_irqrestore(&holder->dma_lock, flags);
+
+	return idle;
+}
+
+/* after terminate_all nothing of the channel is queued any more, wait for
+ * the request the engine runs and for the callbacks */
+static void my_synchronize(struct dma_chan *chan)
+{
+	struct my_chan *mc = to_my_chan(chan);
+
+	wait_event(mc->holder->dma_idle, my_chan_idle(mc));
+	flush_work(&mc->holder->done_work);
+}
+
+static int my_alloc_chan_resources(struct dma_chan *chan)
 {
-	vma->vm_ops = &vos;
 	return 0;
 }
 
+static void my_free_chan_resources(struct dma_chan *chan)
+{
+	struct my_chan *mc = to_my_chan(chan);
+	struct my_desc *desc, *tmp;
+	unsigned long flags;
+	LIST_HEAD(all);
+
+	my_terminate_all(chan);
+	my_synchronize(chan);
+
+	spin_lock_irqsave(&mc->lock, flags);
+	list_splice_init(&mc->completed, &all);
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	list_for_each_entry_safe(desc, tmp, &all, node)
+		kfree(desc);
+}
+
+/* the last reference is gone, remove freed the card resources */
+static void my_holder_release(struct kref *ref)
+{
+	struct holder *holder = container_of(ref, struct holder, ref);
+
+	pci_dev_put(holder->pdev);
+	kfree(holder);
+}
+
+/* the dmaengine core dropped the last user of the channel */
+static void my_dma_release(struct dma_device *dd)
+{
+	struct holder *holder = container_of(dd, struct holder, dma);
+
+	kref_put(&holder->ref, my_holder_release);
+}
+
+/* offer the engine for memcpy and card memory slave transfers, the
+ * dma_device embedded in the holder keeps a reference to it */
+static int my_dmaengine_register(struct holder *holder)
+{
+	struct dma_device *dd = &holder->dma;
+	struct my_chan *mc = &holder->chan;
+	int ret;
+
+	dma_cap_zero(dd->cap_mask);
+	dma_cap_set(DMA_MEMCPY, dd->cap_mask);
+	dma_cap_set(DMA_SLAVE, dd->cap_mask);
+	dd->dev = &holder->pdev->dev;
+	dd->directions = BIT(DMA_MEM_TO_DEV) | BIT(DMA_DEV_TO_MEM);
+	dd->src_addr_widths = BIT(DMA_SLAVE_BUSWIDTH_4_BYTES);
+	dd->dst_addr_widths = BIT(DMA_SLAVE_BUSWIDTH_4_BYTES);
+	dd->residue_granularity = DMA_RESIDUE_GRANULARITY_DESCRIPTOR;
+	dd->device_alloc_chan_resources = my_alloc_chan_resources;
+	dd->device_free_chan_resources = my_free_chan_resources;
+	dd->device_prep_dma_memcpy = my_prep_memcpy;
+	dd->device_prep_slave_sg = my_prep_slave_sg;
+	dd->device_config = my_config;
+	dd->device_terminate_all = my_terminate_all;
+	dd->device_synchronize = my_synchronize;
+	dd->device_issue_pending = my_issue_pending;
+	dd->device_tx_status = my_tx_status;
+	dd->device_release = my_dma_release;
+	INIT_LIST_HEAD(&dd->channels);
+
+	mc->holder = holder;
+	spin_lock_init(&mc->lock);
+	INIT_LIST_HEAD(&mc->submitted);
+	INIT_LIST_HEAD(&mc->completed);
+	mc->chan.device = dd;
+	list_add_tail(&mc->chan.device_node, &dd->channels);
+
+	/* a failed register does not call device_release */
+	kref_get(&holder->ref);
+	ret = dma_async_device_register(dd);
+	if (ret != 0)
+		kref_put(&holder->ref, my_holder_release);
+
+	return ret;
+}
+
+/* the test transfers of probe print data when it is set */
+static void my_test_done(struct my_dma_req *req)
+{
+	if (req->data && req->status == 0)
+		printk(KERN_INFO "%s\n", (char *) req->data);
+	kfree(req);
+}
+
+static int my_test_copy(struct holder *holder, u32 src, u32 dst, u32 cmd,
+	void *print)
+{
+	struct my_dma_req *req;
+	int ret;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (req == NULL)
+		return -ENOMEM;
+
+	req->src = src;
+	req->dst = dst;
+	req->count = 10;
+	req->cmd = cmd;
+	req->done = my_test_done;
+	req->data = print;
+
+	ret = my_dma_submit(holder, req);
+	if (ret != 0)
+		kfree(req);
+
+	return ret;
+}
+
+/* drop the registered buffers of the file (bufs_lock held for writing) */
+static void my_file_free_bufs(struct my_file *mf)
+{
+	int i;
+
+	for (i = 0; i < DMA_BUFS; i++) {
+		if (mf->bufs[i] != NULL)
+			my_buf_free(mf->holder, mf->bufs[i]);
+		mf->bufs[i] = NULL;
+	}
+}
+
+/* the card is going away, wait for the running ioctls and poll, unpin
+ * and unmap the buffers of all files while the device still works and
+ * zap the user mappings of the ring, which remove frees */
+static void my_files_kill(struct holder *holder)
+{
+	struct my_file *mf;
+
+	down_write(&holder->dead_lock);
+	mutex_lock(&holder->files_lock);
+	holder->dead = true;
+	list_for_each_entry(mf, &holder->files, node) {
+		down_write(&mf->bufs_lock);
+		my_file_free_bufs(mf);
+		up_write(&mf->bufs_lock);
+		unmap_mapping_range(mf->filp->f_mapping, 0, 0, 1);
+	}
+	mutex_unlock(&holder->files_lock);
+	up_write(&holder->dead_lock);
+
+	wake_up_interruptible(&holder->ring_wait);
+}
+
+int my_open(struct inode *inode, struct file *filp)
+{
+	/* misc_open points private_data to the misc device of the card, the
+	 * device is registered and the holder alive while we are here */
+	struct miscdevice *misc = filp->private_data;
+	struct my_file *mf;
+
+	mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+	if (mf == NULL)
+		return -ENOMEM;
+
+	mf->holder = container_of(misc, struct holder, misc);
+	mf->filp = filp;
+	init_rwsem(&mf->bufs_lock);
+	kref_get(&mf->holder->ref);
+
+	mutex_lock(&mf->holder->files_lock);
+	list_add_tail(&mf->node, &mf->holder->files);
+	mutex_unlock(&mf->holder->files_lock);
+
+	filp->private_data = mf;
+
+	return 0;
+}
+
+/* drop the buffers the file registered, unless remove did already */
+int my_release(struct inode *inode, struct file *filp)
+{
+	struct my_file *mf = filp->private_data;
+	struct holder *holder = mf->holder;
+
+	down_read(&holder->dead_lock);
+	if (!holder->dead) {
+		down_write(&mf->bufs_lock);
+		my_file_free_bufs(mf);
+		up_write(&mf->bufs_lock);
+	}
+	up_read(&holder->dead_lock);
+
+	mutex_lock(&holder->files_lock);
+	list_del(&mf->node);
+	mutex_unlock(&holder->files_lock);
+
+	kfree(mf);
+	kref_put(&holder->ref, my_holder_release);
+
+	return 0;
+}
+
+/* the pages are inserted by mmap, remove zaps them and frees the ring,
+ * a later access gets SIGBUS */
+static vm_fault_t my_vm_fault(struct vm_fault *vmf)
+{
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct my_vm_ops = {
+	.fault = my_vm_fault,
+};
+
+/* the whole ring, header and slots, until the card is removed */
+int my_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct holder *holder = ((struct my_file *) filp->private_data)->holder;
+	int ret;
+
+	/* remove zaps the mappings under files_lock, we run under mmap_lock
+	 * and can't take dead_lock, ioctls hold it while pinning pages */
+	mutex_lock(&holder->files_lock);
+	if (holder->dead) {
+		mutex_unlock(&holder->files_lock);
+		return -ENODEV;
+	}
+	vma->vm_ops = &my_vm_ops;
+	ret = dma_mmap_coherent(&holder->pdev->dev, vma, holder->virt,
+		holder->phys, holder->ring_size);
+	mutex_unlock(&holder->files_lock);
+
+	return ret;
+}
+
+/* readable when there are published slots to consume */
+static __poll_t my_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct holder *holder = ((struct my_file *) filp->private_data)->holder;
+	struct my_ring_hdr *hdr = holder->virt;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &holder->ring_wait, wait);
+
+	/* the ring is freed once the card is dead */
+	down_read(&holder->dead_lock);
+	if (holder->dead)
+		mask = EPOLLHUP | EPOLLERR;
+	else if (READ_ONCE(holder->ring_head) != READ_ONCE(hdr->tail))
+		mask = EPOLLIN | EPOLLRDNORM;
+	up_read(&holder->dead_lock);
+
+	return mask;
+}
+
+
+static long my_do_ioctl(struct my_file *mf, unsigned int cmd,
+	unsigned long arg)
+{
+	struct my_dma_user u;
+	struct my_dma_reg r;
+	struct my_dma_fixed f;
+	struct my_ring_fill rf;
+	int ret;
+
+	switch (cmd) {
+	case MY_DMA_USER:
+		if (copy_from_user(&u, (void __user *) arg, sizeof(u)) != 0)
+			return -EFAULT;
+		return my_dma_user(mf->holder, &u);
+	case MY_DMA_REGISTER:
+		if (copy_from_user(&r, (void __user *) arg, sizeof(r)) != 0)
+			return -EFAULT;
+		ret = my_buf_register(mf, &r);
+		if (ret != 0)
+			return ret;
+		if (copy_to_user((void __user *) arg, &r, sizeof(r)) != 0) {
+			my_buf_unregister(mf, r.index);
+			return -EFAULT;
+		}
+		return 0;
+	case MY_DMA_UNREGISTER:
+		return my_buf_unregister(mf, (u32) arg);
+	case MY_DMA_FIXED:
+		if (copy_from_user(&f, (void __user *) arg, sizeof(f)) != 0)
+			return -EFAULT;
+		return my_dma_fixed(mf, &f);
+	case MY_RING_FILL:
+		if (copy_from_user(&rf, (void __user *) arg, sizeof(rf)) != 0)
+			return -EFAULT;
+		return my_ring_fill(mf->holder, &rf);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* remove waits for the running ioctls, the later ones fail */
+static long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct my_file *mf = filp->private_data;
+	long ret;
+
+	down_read(&mf->holder->dead_lock);
+	if (mf->holder->dead)
+		ret = -ENODEV;
+	else
+		ret = my_do_ioctl(mf, cmd, arg);
+	up_read(&mf->holder->dead_lock);
+
+	return ret;
+}
 
 static const struct file_operations my_fops = {
 	.owner = THIS_MODULE,
+	.open = my_open,
+	.release = my_release,
 	.mmap = my_mmap,
-};
-
-static struct miscdevice my_misc = {
-	.minor = MISC_DYNAMIC_MINOR,
-	.fops = &my_fops,
-	.name = "my_device",
+	.poll = my_ring_poll,
+	.unlocked_ioctl = my_ioctl,
 };
 
 
@@ -115,8 +1598,8 @@ int my_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	int ret;
 	struct holder *holder;
 
-	printk(KERN_INFO "Adding driver for device [%.4x:%.4x]\n",
-		VENDOR, DEVICE);
+	printk(KERN_INFO "Adding driver for device %s [%.4x:%.4x]\n",
+		pci_name(pdev), VENDOR, DEVICE);
 
 
 	/* enable device */
@@ -130,30 +1613,23 @@ int my_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	}
 
 	/* allocate structure to hold others */
-	holder = kmalloc(sizeof(struct holder), GFP_KERNEL);
+	holder = kzalloc(sizeof(struct holder), GFP_KERNEL);
 	if (holder == NULL) {
-		pci_disable_device(pdev);
-		pci_release_region(pdev, REGION);
-		return -EIO;
+		ret = -ENOMEM;
+		goto err_region;
 	}
 
-	/* create new tasklet */
-	holder->tasklet = kmalloc(sizeof(struct tasklet_struct), GFP_KERNEL);
-	if (holder->tasklet == NULL) {
-		kfree(holder);
-		pci_disable_device(pdev);
-		pci_release_region(pdev, REGION);
-		return -EIO;
-	}
+	holder->pdev = pci_dev_get(pdev);
+	kref_init(&holder->ref);
+	init_rwsem(&holder->dead_lock);
+	mutex_init(&holder->files_lock);
+	INIT_LIST_HEAD(&holder->files);
 
 	/* remap region, undo previous actions on fail */
 	holder->regionPtr = pci_ioremap_bar(pdev, REGION);
 	if (holder->regionPtr == NULL) {
-		kfree(holder->tasklet);
-		kfree(holder);
-		pci_disable_device(pdev);
-		pci_release_region(pdev, REGION);
-		return -EIO;
+		ret = -EIO;
+		goto err_holder;
 	}
 
 	/* set local data for this device */
@@ -173,104 +1649,160 @@ int my_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		(time & 0x00FF0000) >> 16, (time & 0x0000FF00) >> 8,
 		time & 0x000000FF);
 
-
-	/* setup IRQ */
-	ret = request_irq(pdev->irq, my_handler, IRQF_SHARED, "my_interrupt",
-		(void *) holder);
+	/* setup DMA, the card has 32 bit addresses for both kinds of memory */
+	ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
 	if (ret != 0) {
-		printk(KERN_INFO "Cannot request irq\n");
-		kfree(holder->tasklet);
-		kfree(holder);
-		pci_disable_device(pdev);
-		pci_release_region(pdev, REGION);
-		return -EIO;
+		printk(KERN_INFO "Cannot set 32 bit DMA mask\n");
+		goto err_unmap;
 	}
-
-	/* setup DMA */
-	pci_set_dma_mask(pdev, DMA_BIT_MASK(32));
 	pci_set_master(pdev);
-	holder->virt = dma_alloc_coherent(&pdev->dev, PAGE_SIZE, &holder->phys,
-		GFP_KERNEL);
+	/* the ring is one coherent chunk, sizes past the largest buddy
+	 * allocation need CMA or an IOMMU */
+	if (!ring_mb || !slot_size ||
+			((size_t) ring_mb << 20) - RING_DATA < slot_size) {
+		ret = -EINVAL;
+		goto err_unmap;
+	}
+	holder->ring_size = (size_t) ring_mb << 20;
+	holder->virt = dma_alloc_coherent(&pdev->dev, holder->ring_size,
+		&holder->phys, GFP_KERNEL);
+	if (holder->virt == NULL) {
+		ret = -ENOMEM;
+		goto err_unmap;
+	}
+	my_ring_init(holder);
+	holder->ring_reqs = kcalloc(holder->ring_slots,
+		sizeof(*holder->ring_reqs), GFP_KERNEL);
+	if (holder->ring_reqs == NULL) {
+		ret = -ENOMEM;
+		goto err_ring;
+	}
+
+	hrtimer_init(&holder->poll_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL_SOFT);
+	holder->poll_timer.function = my_poll;
+
+	spin_lock_init(&holder->event_lock);
+	spin_lock_init(&holder->dma_lock);
+	INIT_LIST_HEAD(&holder->dma_pending);
+	INIT_LIST_HEAD(&holder->dma_done);
+	init_waitqueue_head(&holder->dma_idle);
 
-	/* initialise tasklet (we have the virt memory pointer now) */
-	tasklet_init(holder->tasklet, &tasklet_func,
-		(unsigned long) holder->virt);
+	INIT_WORK(&holder->done_work, my_done_work);
 
-	/* register the device that allows to mmap the memory */
-	/* let the device access the memory: won't work with multiple devs */
-	miscPtr = holder->virt;
-	ret = misc_register(&my_misc);
+	/* setup IRQ */
+	ret = my_request_irqs(pdev, holder);
 	if (ret != 0) {
-		dma_free_coherent(&pdev->dev, PAGE_SIZE, holder->virt,
-			holder->phys);
-		kfree(holder->tasklet);
-		kfree(holder);
-		pci_disable_device(pdev);
-		pci_release_region(pdev, REGION);
-		return ret;
+		printk(KERN_INFO "Cannot request irq\n");
+		goto err_dma;
+	}
+
+	/* register the device that allows to mmap the memory of this card */
+	holder->id = ida_alloc(&my_ida, GFP_KERNEL);
+	if (holder->id < 0) {
+		ret = holder->id;
+		goto err_irq;
 	}
+	snprintf(holder->name, sizeof(holder->name), "my_device%d",
+		holder->id);
+	holder->misc.minor = MISC_DYNAMIC_MINOR;
+	holder->misc.fops = &my_fops;
+	holder->misc.name = holder->name;
+	holder->misc.parent = &pdev->dev;
+	ret = misc_register(&holder->misc);
+	if (ret != 0)
+		goto err_ida;
+
+	ret = my_dmaengine_register(holder);
+	if (ret != 0)
+		goto err_misc;
 
 	/* allow interrupts in card */
-	writel(0x1000|0x0100, INT_ENABLE(holder->regionPtr));
-
-	/* copy to card */
-	strcpy(holder->virt, "retezec10b");
-	writel(holder->phys, DMA_SRC(holder->regionPtr));
-	writel(0x40000, DMA_DST(holder->regionPtr));
-	writel(10, DMA_COUNT(holder->regionPtr));
-	writel(0x1 | (0x1 << 7) | (0x2 << 1) | (0x4 << 4),
-		DMA_CMD(holder->regionPtr));
-	/* wait for the transfer to finish */
-	while (readl(DMA_CMD(holder->regionPtr)) & 0x01)
-		;
-
-	/* copy from card */
-	writel(0x40000, DMA_SRC(holder->regionPtr));
-	writel(holder->phys+10, DMA_DST(holder->regionPtr));
-	writel(10, DMA_COUNT(holder->regionPtr));
-	writel(0x1 | (0x1 << 7) | (0x2 << 4) | (0x4 << 1),
-		DMA_CMD(holder->regionPtr));
-	/* wait for the transfer to finish */
-	while (readl(DMA_CMD(holder->regionPtr)) & 0x01)
-		;
-
-	/* copy from card with IRQ */
-	writel(0x40000, DMA_SRC(holder->regionPtr));
-	writel(holder->phys+20, DMA_DST(holder->regionPtr));
-	writel(10, DMA_COUNT(holder->regionPtr));
-	writel(0x1 | (0x2 << 4) | (0x4 << 1), DMA_CMD(holder->regionPtr));
+	writel(INT_ALL, INT_ENABLE(holder->regionPtr));
+
+	/* queue the test transfers, each starts when the previous one
+	 * completes: copy to card, back from card twice, print the last.
+	 * They use the first slot, which is not published yet */
+	strcpy(holder->virt+RING_DATA, "retezec10b");
+	my_test_copy(holder, holder->phys+RING_DATA, 0x40000,
+		DMA_CMD_SRC(DMA_HOST) | DMA_CMD_DST(DMA_CARD), NULL);
+	my_test_copy(holder, 0x40000, holder->phys+RING_DATA+10,
+		DMA_CMD_SRC(DMA_CARD) | DMA_CMD_DST(DMA_HOST), NULL);
+	my_test_copy(holder, 0x40000, holder->phys+RING_DATA+20,
+		DMA_CMD_SRC(DMA_CARD) | DMA_CMD_DST(DMA_HOST),
+		holder->virt+RING_DATA+20);
 
 	return 0;
+
+	/* undo previous actions in reverse order */
+err_misc:
+	misc_deregister(&holder->misc);
+err_ida:
+	ida_free(&my_ida, holder->id);
+err_irq:
+	my_free_irqs(pdev, holder);
+err_dma:
+	cancel_work_sync(&holder->done_work);
+	kfree(holder->ring_reqs);
+err_ring:
+	dma_free_coherent(&pdev->dev, holder->ring_size, holder->virt,
+		holder->phys);
+err_unmap:
+	iounmap(holder->regionPtr);
+err_holder:
+	pci_dev_put(holder->pdev);
+	kfree(holder);
+err_region:
+	pci_release_region(pdev, REGION);
+	pci_disable_device(pdev);
+	return ret;
 }
 
 void my_remove(struct pci_dev *pdev)
 {
 	struct holder *holder = (struct holder *) pci_get_drvdata(pdev);
 
-	printk(KERN_INFO "Removing driver for device [%.4x:%.4x]\n",
-		VENDOR, DEVICE);
+	printk(KERN_INFO "Removing driver for device %s [%.4x:%.4x]\n",
+		pci_name(pdev), VENDOR, DEVICE);
+
+	/* no new opens, then no more ioctls and no registered buffers, the
+	 * files stay open and keep the holder */
+	misc_deregister(&holder->misc);
+	ida_free(&my_ida, holder->id);
+	my_files_kill(holder);
+
+	/* no new dmaengine clients, then finish the transfers while the
+	 * completion interrupt works. The core drops the reference of the
+	 * dma_device once its last user is gone, maybe after we return */
+	dma_async_device_unregister(&holder->dma);
+	my_dma_stop(holder);
 
 	/* disable interrups */
 	writel(0x0000, INT_ENABLE(holder->regionPtr));
 
 	/* remove IRQ */
-	free_irq(pdev->irq, (void *) holder);
+	my_free_irqs(pdev, holder);
+	/* no new interrupts, then stop polling, which may have enabled them */
+	hrtimer_cancel(&holder->poll_timer);
+	writel(0x0000, INT_ENABLE(holder->regionPtr));
+
+	printk(KERN_INFO "%lu interrupts, %lu events polled\n", holder->irqs,
+		holder->polled);
 
-	/* remove the device that mmaps the memory */
-	misc_deregister(&my_misc);
+	/* run the callbacks of the last completions */
+	flush_work(&holder->done_work);
 
-	/* free DMA memory */
-	dma_free_coherent(&pdev->dev, PAGE_SIZE, holder->virt, holder->phys);
+	/* the engine is done with the ring and my_files_kill zapped the user
+	 * mappings, free it while we are still bound */
+	kfree(holder->ring_reqs);
+	dma_free_coherent(&pdev->dev, holder->ring_size, holder->virt,
+		holder->phys);
 
 	/* unmap requested region */
 	iounmap(holder->regionPtr);
 
-	/* stop and delete the tasklet */
-	tasklet_kill(holder->tasklet);
-	kfree(holder->tasklet);
-
-	/* free the holder structure */
-	kfree(holder);
+	/* drop the reference of probe */
+	kref_put(&holder->ref, my_holder_release);
 
 	/* release the region */
 	pci_release_region(pdev, REGION);